@@ -2,11 +2,14 @@
 #define _POSIX_C_SOURCE 200809L // 謎?
 #include <assert.h>
 #include <ctype.h> // typedef
+#include <limits.h>
+#include <setjmp.h> // コンパイルサーバでのエラー処理
 #include <stdarg.h> // va_*
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h> // clock_gettime
 
 //
 // tokenize.c
@@ -36,6 +39,8 @@ struct Token {
   int len; // トークンの長さ
 };
 
+extern jmp_buf *error_jmp;
+
 void error(char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
@@ -65,6 +70,7 @@ typedef enum {
               ND_NE, // !=
               ND_LT, // <
               ND_LE, // <=
+              ND_COND, // cond ? then : els (if変換で作る)
               ND_ASSIGN, // =
               ND_RETURN, // return
               ND_IF, // if文
@@ -84,7 +90,7 @@ struct Node {
   Node *lhs; // 左辺
   Node *rhs; // 右辺
 
-  // kindがND_IF, ND_FORの場合のみ使う
+  // kindがND_IF, ND_FOR, ND_CONDの場合のみ使う
   Node *cond; // 条件 
   Node *then; // 条件が真のとき
   Node *els; // 条件が偽のとき
@@ -95,21 +101,86 @@ struct Node {
   
   Var *var; // kindがND_VARの場合のみ使う
   long val; // kindがND_NUMの場合のみ使う
+  int branch_id; // kindがND_IFの場合，ソース中の通し番号 (プロファイルとの対応付け)
+
+  struct Label *label; // 命令選択のラベル (codegen.cで使う)
 };
 
+typedef struct Insn Insn;
+
 typedef struct Function Function;
 struct Function{
   Node *node;
   Var *locals;
   int stack_size;
+  Insn *insns; // codegenが作る命令列
 };
 
 // parseのときの返り値を構造体Functionで返す
 Function *parse(Token *tok);
 
 
+//
+// opt.c
+//
+
+// パスが対象とするIR
+typedef enum {
+  PASS_AST, // parse後のAST
+  PASS_INSN, // codegen後の命令列
+} PassStage;
+
+extern bool time_report;
+
+void opt_reset(void);
+void opt_set_level(int level);
+void opt_set_profile(char *path);
+void opt_set_pass(char *name, bool enable);
+void run_passes(Function *prog, PassStage stage);
+bool has_side_effect(Node *node);
+
 //
 // codegen.c
 //
 
+#define NREGS 6 // 式の計算に使えるレジスタ (r10〜r15) の数
+
+// 出力する命令またはラベル
+struct Insn {
+  Insn *next;
+  char *label; // ラベルならその名前，命令ならNULL
+  char *op; // 命令名
+  char *opnd[3]; // オペランド
+  int nopnd;
+};
+
 void codegen(Function *prog);
+void emit_asm(Function *prog);
+
+//
+// sched.c
+//
+
+void sched_set_model(char *name);
+int schedule(Function *prog);
+
+//
+// arena.c
+//
+
+void *arena_calloc(size_t n, size_t size);
+char *arena_strndup(char *s, size_t n);
+void arena_reset(void);
+
+//
+// server.c
+//
+
+int server_main(int argc, char **argv);
+
+//
+// main.c
+//
+
+char *parse_args(int argc, char **argv);
+void compile(char *input);
@@ -0,0 +1,69 @@
+#include "9cc.h"
+
+// アリーナアロケータ
+// トークンやノードは1回のコンパイルが終わるまで解放しないので，大きな
+// ブロックから順に切り出す。arena_reset()で全てを解放したことにして，
+// 次のコンパイルで同じブロックを使い回す (コンパイルサーバ用)。
+
+#define BLOCK_SIZE (1024 * 1024)
+
+typedef struct Block Block;
+struct Block {
+  Block *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+static Block *head; // 最初のブロック
+static Block *cur; // 今切り出しているブロック
+
+static Block *new_block(size_t size) {
+  Block *b = malloc(sizeof(Block) + size);
+  if (!b)
+    error("out of memory");
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+// ゼロクリアされたn * sizeバイトの領域を返す
+void *arena_calloc(size_t n, size_t size) {
+  size_t len = (n * size + 15) & ~(size_t)15;
+
+  // 次のブロックで足りなければ新しいブロックを挿む
+  while (!cur || cur->used + len > cur->size) {
+    if (cur && cur->next && cur->next->size >= len) {
+      cur = cur->next;
+      cur->used = 0;
+      continue;
+    }
+    Block *b = new_block(len > BLOCK_SIZE ? len : BLOCK_SIZE);
+    if (cur) {
+      b->next = cur->next;
+      cur->next = b;
+    } else {
+      head = b;
+    }
+    cur = b;
+  }
+
+  void *p = cur->data + cur->used;
+  cur->used += len;
+  memset(p, 0, len);
+  return p;
+}
+
+char *arena_strndup(char *s, size_t n) {
+  size_t len = strnlen(s, n);
+  char *p = arena_calloc(1, len + 1);
+  memcpy(p, s, len);
+  return p;
+}
+
+void arena_reset(void) {
+  cur = head;
+  if (cur)
+    cur->used = 0;
+}
@@ -0,0 +1,128 @@
+#!/bin/bash
+# 9ccが生成するコードの実行速度を測る
+#
+# 使い方: bench/bench.sh [--update-baseline]
+#
+# bench/kernels/*.9cc を9ccの各最適化レベルと，参考としてgcc -O0/-O2で
+# コンパイルし，bench/runnerでCPUを固定して実行する。結果はbench_output.txtに
+# 書き出し，bench/baseline.tsvに対する比 (小さいほど速い) を表示する。
+# ベースラインと測り方 (perfかrdtsc) が違う構成の比は - になる。
+# --update-baseline を付けると今回の結果を新しいベースラインにする。
+#
+# 環境変数
+#   BENCH_CPU    固定するCPU (既定値 0)
+#   BENCH_REPEAT 1つの構成を実行する回数 (既定値 3，最小値を採る)
+
+cd "$(dirname "$0")/.." || exit 1
+
+CPU="${BENCH_CPU:-0}"
+REPEAT="${BENCH_REPEAT:-3}"
+BASELINE=bench/baseline.tsv
+OUTPUT=bench_output.txt
+CONFIGS="9cc-O0 9cc-O1 9cc-O2 gcc-O0 gcc-O2"
+
+update=0
+if [ "$1" = "--update-baseline" ]; then
+  update=1
+elif [ -n "$1" ]; then
+  echo "usage: $0 [--update-baseline]" >&2
+  exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# gccでコンパイルするために，使われている変数をlongで宣言したmainで包む
+# カーネルの入力は全て定数なので，そのままではgcc -O2がコンパイル時に結果を
+# 求めてしまう。変数の初期値 (x=定数;) にargcから作った0 (z_) を足して
+# 実行時まで隠す。ループの刻みや比較の定数はそのままにしておく
+wrap_c() {
+  vars=$(grep -oE '[A-Za-z_][A-Za-z0-9_]*' "$1" | sort -u |
+         grep -vxE 'return|if|else|for|while' | paste -sd, -)
+  body=$(sed -E 's/([A-Za-z_][A-Za-z0-9_]*)=([0-9]+);/\1=\2+z_;/g' "$1")
+  echo "int main(int argc, char **argv) { long z_ = argc - 1; long $vars; $body }"
+}
+
+# $1のカーネルを構成$2でコンパイルし，実行ファイル$3を作る
+build() {
+  case "$2" in
+  9cc-*)
+    ./9cc "${2#9cc}" "$(cat "$1")" > "$3.s" || return 1
+    gcc -static -o "$3" "$3.s" 2> /dev/null
+    ;;
+  gcc-*)
+    wrap_c "$1" > "$3.c"
+    gcc -static -w "${2#gcc}" -o "$3" "$3.c"
+    ;;
+  esac
+}
+
+# ベースラインのサイクル数
+# perfのユーザーモードのサイクル数とrdtscの経過時間は比べられないので，
+# 測り方 ($3) がベースラインと違えば何も返さない
+baseline() {
+  [ -f "$BASELINE" ] &&
+    awk -v k="$1" -v c="$2" -v s="$3" '$1 == k && $2 == c && $5 == s { print $3 }' "$BASELINE"
+}
+
+ratio() {
+  if [ -z "$2" ] || [ "$1" = - ] || [ "$2" = - ]; then
+    echo -
+  else
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", a / b }'
+  fi
+}
+
+printf "kernel\tconfig\tcycles\tinstructions\tbranch_misses\tl1d_misses\tstatus\tsource\n" > "$OUTPUT"
+printf "%-12s %-7s %14s %14s %12s %12s %8s\n" \
+       kernel config cycles instructions br-miss l1d-miss baseline
+
+failed=0
+for kernel in bench/kernels/*.9cc; do
+  name=$(basename "$kernel" .9cc)
+  expected=
+
+  for config in $CONFIGS; do
+    exe="$tmp/$name-$config"
+    if ! build "$kernel" "$config" "$exe"; then
+      echo "$name: $config: compile failed"
+      failed=1
+      continue
+    fi
+
+    read -r cycles insns brmiss l1miss status source < <(bench/runner -c "$CPU" -r "$REPEAT" "$exe")
+    [ -z "$cycles" ] && { failed=1; continue; }
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+           "$name" "$config" "$cycles" "$insns" "$brmiss" "$l1miss" "$status" "$source" >> "$OUTPUT"
+
+    # 全ての構成で結果が一致しなければならない
+    [ -z "$expected" ] && expected=$status
+    if [ "$status" != "$expected" ]; then
+      echo "$name: $config: exit status $status, but $expected expected"
+      failed=1
+    fi
+
+    printf "%-12s %-7s %14s %14s %12s %12s %8s\n" "$name" "$config" "$cycles" "$insns" \
+           "$brmiss" "$l1miss" "$(ratio "$cycles" "$(baseline "$name" "$config" "$source")")"
+  done
+done
+
+# 構成ごとのgcc -O2に対するサイクル数の比 (カーネル全体の幾何平均)
+echo
+awk -F'\t' -v configs="$CONFIGS" 'NR > 1 { c[$1, $2] = $3; k[$1] = 1 }
+  END {
+    n = split(configs, cfg, " ")
+    for (i = 1; i <= n; i++) {
+      s = 0; m = 0
+      for (name in k)
+        if (c[name, cfg[i]] > 0 && c[name, "gcc-O2"] > 0) { s += log(c[name, cfg[i]] / c[name, "gcc-O2"]); m++ }
+      if (m) printf "%-7s %.3fx gcc-O2\n", cfg[i], exp(s / m)
+    }
+  }' "$OUTPUT"
+
+if [ "$update" = 1 ]; then
+  cut -f1-4,8 "$OUTPUT" | tail -n +2 > "$BASELINE"
+  echo "updated $BASELINE"
+fi
+
+exit $failed
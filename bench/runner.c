@@ -0,0 +1,176 @@
+// ベンチマークの実行器
+//
+// 使い方: runner [-c cpu] [-r repeat] program [args...]
+//
+// programを指定したCPUに固定して実行し，perf_event_openでサイクル数，命令数，
+// 分岐予測ミス，L1データキャッシュミスを数える。perf_event_openが使えない
+// 環境ではrdtscで経過サイクルだけを測る。repeat回実行して最もサイクル数の
+// 少なかった回の値を，次の形式で1行に出力する。
+//
+//   cycles instructions branch_misses l1d_misses status source
+//
+// 測れなかった値は-，statusはprogramの終了コード，sourceはperfかrdtsc。
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#define NCOUNTERS 4
+
+static struct {
+  uint32_t type;
+  uint64_t config;
+} counters[NCOUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+   PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+
+typedef struct {
+  int64_t val[NCOUNTERS]; // 測れなかったものは-1
+  int status;
+  bool perf;
+} Result;
+
+static void error(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "runner: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+// execされた時点から数え始める
+static int perf_open(int i, pid_t pid) {
+  struct perf_event_attr attr = {0};
+  attr.size = sizeof(attr);
+  attr.type = counters[i].type;
+  attr.config = counters[i].config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+static int wait_child(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      error("waitpid: %s", strerror(errno));
+  if (!WIFEXITED(status))
+    error("program was killed by signal %d", WTERMSIG(status));
+  return WEXITSTATUS(status);
+}
+
+// 子プロセスはパイプが閉じられるまでexecを待つので，
+// その間に親が子に対してカウンタを開ける
+static Result run(char **argv) {
+  Result res;
+  for (int i = 0; i < NCOUNTERS; i++)
+    res.val[i] = -1;
+
+  int fds[2];
+  if (pipe(fds) < 0)
+    error("pipe: %s", strerror(errno));
+
+  uint64_t start = __rdtsc();
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    char c;
+    close(fds[1]);
+    if (read(fds[0], &c, 1) < 0)
+      _exit(127);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(fds[0]);
+
+  int fd[NCOUNTERS];
+  fd[0] = perf_open(0, pid);
+  res.perf = fd[0] >= 0;
+  for (int i = 1; i < NCOUNTERS; i++)
+    fd[i] = res.perf ? perf_open(i, pid) : -1;
+
+  close(fds[1]);
+  res.status = wait_child(pid);
+  uint64_t end = __rdtsc();
+
+  if (!res.perf) {
+    res.val[0] = end - start;
+    return res;
+  }
+
+  for (int i = 0; i < NCOUNTERS; i++) {
+    if (fd[i] < 0)
+      continue;
+    uint64_t val;
+    if (read(fd[i], &val, sizeof(val)) == sizeof(val))
+      res.val[i] = val;
+    close(fd[i]);
+  }
+  return res;
+}
+
+int main(int argc, char **argv) {
+  int cpu = 0;
+  int repeat = 3;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+c:r:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cpu = atoi(optarg);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    default:
+      error("usage: runner [-c cpu] [-r repeat] program [args...]");
+    }
+  }
+  if (optind == argc || repeat < 1)
+    error("usage: runner [-c cpu] [-r repeat] program [args...]");
+
+  // 子プロセスにも引き継がれる
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    error("cannot pin to cpu %d: %s", cpu, strerror(errno));
+
+  Result best = run(argv + optind);
+  for (int i = 1; i < repeat; i++) {
+    Result res = run(argv + optind);
+    if (res.status != best.status)
+      error("exit status changed between runs: %d, %d", best.status, res.status);
+    if (res.val[0] < best.val[0])
+      best = res;
+  }
+
+  for (int i = 0; i < NCOUNTERS; i++) {
+    if (best.val[i] < 0)
+      printf("-\t");
+    else
+      printf("%lld\t", (long long)best.val[i]);
+  }
+  printf("%d\t%s\n", best.status, best.perf ? "perf" : "rdtsc");
+  return 0;
+}
@@ -0,0 +1,95 @@
+// コンパイルサーバのクライアント
+//
+// 使い方: 9cc-client [-S <socket>] [9ccのオプション...] <program>
+//
+// 9ccと同じ引数を受け取り，9cc --serverで起動したサーバにコンパイルを
+// 依頼する。アセンブリを標準出力に，エラーを標準エラー出力に書き，
+// 9ccと同じ終了コードで終わる。ソケットは-Sか環境変数NINECC_SOCKETで指定し，
+// どちらもなければ/tmp/9cc.sockを使う。プロトコルはserver.cを参照。
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void error(char *msg) {
+  fprintf(stderr, "9cc-client: %s\n", msg);
+  exit(1);
+}
+
+static void read_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0; ) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0)
+      error("connection closed by server");
+    p += n;
+    len -= n;
+  }
+}
+
+static void write_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0; ) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      error("write failed");
+    p += n;
+    len -= n;
+  }
+}
+
+// サーバから受け取ったlenバイトをoutにそのまま流す
+static void copy(int fd, FILE *out, uint32_t len) {
+  char buf[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    read_full(fd, buf, n);
+    fwrite(buf, 1, n, out);
+    len -= n;
+  }
+}
+
+int main(int argc, char **argv) {
+  char *path = getenv("NINECC_SOCKET");
+  if (!path)
+    path = "/tmp/9cc.sock";
+
+  // -Sとそれ以外の引数を分ける。最後の引数がプログラム
+  char **args = calloc(argc, sizeof(char *));
+  int nargs = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-S") && i + 1 < argc)
+      path = argv[++i];
+    else
+      args[nargs++] = argv[i];
+  }
+  if (nargs == 0)
+    error("usage: 9cc-client [-S <socket>] [options...] <program>");
+
+  // 最後の文字列以外はNUL終端で送る
+  uint32_t len = 0;
+  for (int i = 0; i < nargs; i++)
+    len += strlen(args[i]) + (i < nargs - 1);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path too long");
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    error("cannot connect to server");
+
+  uint32_t hdr[2] = {nargs - 1, len};
+  write_full(fd, hdr, sizeof(hdr));
+  for (int i = 0; i < nargs; i++)
+    write_full(fd, args[i], strlen(args[i]) + (i < nargs - 1));
+
+  uint32_t res[3];
+  read_full(fd, res, sizeof(res));
+  copy(fd, stdout, res[1]);
+  copy(fd, stderr, res[2]);
+  return res[0];
+}
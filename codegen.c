@@ -3,96 +3,490 @@
 static int top;
 static int labelseq = 1;
 
+// 出力する命令列の末尾
+static Insn **insn_tail;
+
+static char *trim(char *p) {
+  while (*p == ' ')
+    p++;
+  char *end = p + strlen(p);
+  while (end > p && end[-1] == ' ')
+    *--end = '\0';
+  return p;
+}
+
+// 1行分のアセンブリを命令名とオペランドに分解してInsnにする
+static Insn *new_insn(char *line) {
+  Insn *insn = arena_calloc(1, sizeof(Insn));
+  line = trim(line);
+
+  int len = strlen(line);
+  if (line[len - 1] == ':') {
+    insn->label = arena_strndup(line, len - 1);
+    return insn;
+  }
+
+  char *sp = strchr(line, ' ');
+  if (!sp) {
+    insn->op = arena_strndup(line, len);
+    return insn;
+  }
+  insn->op = arena_strndup(line, sp - line);
+
+  for (char *p = sp + 1; *p; ) {
+    if (insn->nopnd == sizeof(insn->opnd) / sizeof(*insn->opnd))
+      error("too many operands: %s", line);
+    char *comma = strchr(p, ',');
+    char *end = comma ? comma : p + strlen(p);
+    insn->opnd[insn->nopnd++] = trim(arena_strndup(p, end - p));
+    p = comma ? comma + 1 : end;
+  }
+  return insn;
+}
+
+// 命令を命令列に追加する。改行で区切れば複数の命令を追加できる
+static void emit(char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+    *insn_tail = new_insn(line);
+    insn_tail = &(*insn_tail)->next;
+  }
+}
+
 // レジスタ関数
 static char *reg(int idx){
-  static char *r[] = {"r10", "r11", "r12", "r13", "r14", "r15"};
+  static char *r[NREGS] = {"r10", "r11", "r12", "r13", "r14", "r15"};
   if (idx < 0 || sizeof(r) / sizeof(*r) <= idx)
     error("register out of range: %d, idx");
   return r[idx];
 }
 
-static void gen_addr(Node *node){
-  if (node->kind == ND_VAR){
-    printf("  lea %s, [rbp-%d]\n", reg(top++), node->var->offset);
+//
+// 命令選択
+//
+// BURS形式の木パターンマッチングで式を命令に変換する。
+// 各ノードについて「その部分木を非終端記号ntとして得るための最小コスト」と
+// そのときに使う規則をボトムアップに求め (label)，トップダウンに命令を出力する (reduce)。
+//
+
+// 非終端記号
+typedef enum {
+  NT_NONE = -1,
+  NT_REG, // レジスタに置かれた値
+  NT_IMM, // 32ビットに収まる即値
+  NT_MEM, // [rbp-N] のメモリオペランド
+  NT_SCALE, // アドレスのスケールにできる定数 (1, 2, 4, 8)
+  NT_SCALE3, // lea r, [r+r*k] で表せる乗数 (3, 5, 9)
+  NT_INDEX, // reg*scale
+  NT_ADDR, // base + index*scale
+  NT_ADDRD, // base + index*scale + disp
+  NT_MAX,
+} NonTerm;
+
+// オペランド
+typedef struct {
+  NonTerm nt;
+  int base; // ベースレジスタ (なければ-1)
+  int index; // インデックスレジスタ (なければ-1)
+  int scale;
+  long disp; // 即値，変位，またはrbpからのオフセット
+} Operand;
+
+#define CHAIN -1 // 連鎖規則 (nt <- l)
+#define INF (INT_MAX / 2)
+
+// 命令選択の規則
+typedef struct {
+  int kind; // 対象ノードの種類かCHAIN
+  NonTerm nt; // 規則が生成する非終端記号
+  NonTerm l, r; // 左右の子 (連鎖規則ならlが元の非終端記号)
+  int cost; // 命令のコスト (おおよそのレイテンシ)
+  char *tmpl; // 出力する命令。%0は結果，%l, %rは左右のオペランド
+  bool (*pred)(Node *node); // 葉の規則が使えるかどうか
+  void (*build)(Operand *op, Operand *l, Operand *r); // 命令を出さない規則
+} Rule;
+
+struct Label {
+  int cost[NT_MAX];
+  Rule *rule[NT_MAX];
+};
+
+static bool is_imm32(Node *node) {
+  return INT_MIN <= node->val && node->val <= INT_MAX;
+}
+
+static bool is_scale(Node *node) {
+  return node->val == 1 || node->val == 2 || node->val == 4 || node->val == 8;
+}
+
+static bool is_scale3(Node *node) {
+  return node->val == 3 || node->val == 5 || node->val == 9;
+}
+
+// 左の変数をメモリオペランドにすると，右の部分木を評価した後に読むことになる。
+// 右で代入しているときは左から順に評価した値と変わりうるので使わない
+static bool rhs_pure(Node *node) {
+  return !has_side_effect(node->rhs);
+}
+
+static void leaf(Operand *op, Operand *l, Operand *r) {
+  NonTerm nt = op->nt;
+  *op = *l;
+  op->nt = nt;
+}
+
+// reg*scale
+static void index_lr(Operand *op, Operand *l, Operand *r) {
+  op->index = l->base;
+  op->scale = r->disp;
+}
+
+static void index_rl(Operand *op, Operand *l, Operand *r) {
+  index_lr(op, r, l);
+}
+
+// reg*k = reg + reg*(k-1)
+static void scale3_lr(Operand *op, Operand *l, Operand *r) {
+  op->base = l->base;
+  op->index = l->base;
+  op->scale = r->disp - 1;
+}
+
+static void scale3_rl(Operand *op, Operand *l, Operand *r) {
+  scale3_lr(op, r, l);
+}
+
+// アドレスの足し算
+static void merge(Operand *op, Operand *l, Operand *r) {
+  NonTerm nt = op->nt;
+  *op = *l;
+  op->nt = nt;
+  if (l->nt == NT_IMM)
+    op->base = op->index = -1;
+
+  if (r->nt == NT_IMM) {
+    op->disp += r->disp;
     return;
   }
+  if (r->index >= 0) {
+    op->index = r->index;
+    op->scale = r->scale;
+  }
+  if (r->base >= 0) {
+    if (op->base < 0) {
+      op->base = r->base;
+    } else {
+      op->index = r->base;
+      op->scale = 1;
+    }
+  }
+}
+
+static Rule rules[] = {
+  // 葉
+  {ND_NUM, NT_IMM, NT_NONE, NT_NONE, 0, NULL, is_imm32, leaf},
+  {ND_NUM, NT_SCALE, NT_NONE, NT_NONE, 0, NULL, is_scale, leaf},
+  {ND_NUM, NT_SCALE3, NT_NONE, NT_NONE, 0, NULL, is_scale3, leaf},
+  {ND_NUM, NT_REG, NT_NONE, NT_NONE, 1, "mov %0, %l"},
+  {ND_VAR, NT_MEM, NT_NONE, NT_NONE, 0, NULL, NULL, leaf},
+
+  // 連鎖規則
+  {CHAIN, NT_REG, NT_MEM, NT_NONE, 1, "mov %0, %l"},
+  {CHAIN, NT_REG, NT_INDEX, NT_NONE, 1, "lea %0, %l"},
+  {CHAIN, NT_REG, NT_ADDR, NT_NONE, 1, "lea %0, %l"},
+  {CHAIN, NT_REG, NT_ADDRD, NT_NONE, 1, "lea %0, %l"},
+  {CHAIN, NT_ADDR, NT_INDEX, NT_NONE, 0, NULL, NULL, leaf},
+
+  // 代入
+  {ND_ASSIGN, NT_REG, NT_MEM, NT_REG, 1, "mov %l, %0"},
+
+  // 算術演算
+  {ND_ADD, NT_REG, NT_REG, NT_REG, 1, "add %0, %r"},
+  {ND_ADD, NT_REG, NT_REG, NT_IMM, 1, "add %0, %r"},
+  {ND_ADD, NT_REG, NT_REG, NT_MEM, 1, "add %0, %r"},
+  {ND_ADD, NT_REG, NT_IMM, NT_REG, 1, "add %0, %l"},
+  {ND_ADD, NT_REG, NT_MEM, NT_REG, 1, "add %0, %l", rhs_pure},
+  {ND_SUB, NT_REG, NT_REG, NT_REG, 1, "sub %0, %r"},
+  {ND_SUB, NT_REG, NT_REG, NT_IMM, 1, "sub %0, %r"},
+  {ND_SUB, NT_REG, NT_REG, NT_MEM, 1, "sub %0, %r"},
+  {ND_MUL, NT_REG, NT_REG, NT_REG, 3, "imul %0, %r"},
+  {ND_MUL, NT_REG, NT_REG, NT_MEM, 3, "imul %0, %r"},
+  {ND_MUL, NT_REG, NT_MEM, NT_REG, 3, "imul %0, %l", rhs_pure},
+  {ND_MUL, NT_REG, NT_REG, NT_IMM, 3, "imul %0, %l, %r"},
+  {ND_MUL, NT_REG, NT_IMM, NT_REG, 3, "imul %0, %r, %l"},
+  {ND_MUL, NT_REG, NT_MEM, NT_IMM, 3, "imul %0, %l, %r"},
+  {ND_MUL, NT_REG, NT_IMM, NT_MEM, 3, "imul %0, %r, %l"},
+  {ND_DIV, NT_REG, NT_REG, NT_REG, 20, "mov rax, %0\n  cqo\n  idiv %r\n  mov %0, rax"},
+  {ND_DIV, NT_REG, NT_REG, NT_MEM, 20, "mov rax, %0\n  cqo\n  idiv %r\n  mov %0, rax"},
+
+  // アドレス計算 (lea)
+  {ND_MUL, NT_INDEX, NT_REG, NT_SCALE, 0, NULL, NULL, index_lr},
+  {ND_MUL, NT_INDEX, NT_SCALE, NT_REG, 0, NULL, NULL, index_rl},
+  {ND_MUL, NT_ADDR, NT_REG, NT_SCALE3, 0, NULL, NULL, scale3_lr},
+  {ND_MUL, NT_ADDR, NT_SCALE3, NT_REG, 0, NULL, NULL, scale3_rl},
+  {ND_ADD, NT_ADDR, NT_REG, NT_REG, 0, NULL, NULL, merge},
+  {ND_ADD, NT_ADDR, NT_REG, NT_INDEX, 0, NULL, NULL, merge},
+  {ND_ADD, NT_ADDR, NT_INDEX, NT_REG, 0, NULL, NULL, merge},
+  {ND_ADD, NT_ADDRD, NT_ADDR, NT_IMM, 0, NULL, NULL, merge},
+  {ND_ADD, NT_ADDRD, NT_IMM, NT_ADDR, 0, NULL, NULL, merge},
 
-  error("not an lvalue");
+  // 比較 (cmp + setcc + movzx)
+  {ND_EQ, NT_REG, NT_REG, NT_REG, 3, "cmp %0, %r\n  sete al\n  movzx %0, al"},
+  {ND_EQ, NT_REG, NT_REG, NT_IMM, 3, "cmp %0, %r\n  sete al\n  movzx %0, al"},
+  {ND_EQ, NT_REG, NT_REG, NT_MEM, 3, "cmp %0, %r\n  sete al\n  movzx %0, al"},
+  {ND_EQ, NT_REG, NT_IMM, NT_REG, 3, "cmp %0, %l\n  sete al\n  movzx %0, al"},
+  {ND_EQ, NT_REG, NT_MEM, NT_REG, 3, "cmp %0, %l\n  sete al\n  movzx %0, al", rhs_pure},
+  {ND_EQ, NT_REG, NT_MEM, NT_IMM, 3, "cmp %l, %r\n  sete al\n  movzx %0, al"},
+  {ND_EQ, NT_REG, NT_IMM, NT_MEM, 3, "cmp %r, %l\n  sete al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_REG, NT_REG, 3, "cmp %0, %r\n  setne al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_REG, NT_IMM, 3, "cmp %0, %r\n  setne al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_REG, NT_MEM, 3, "cmp %0, %r\n  setne al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_IMM, NT_REG, 3, "cmp %0, %l\n  setne al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_MEM, NT_REG, 3, "cmp %0, %l\n  setne al\n  movzx %0, al", rhs_pure},
+  {ND_NE, NT_REG, NT_MEM, NT_IMM, 3, "cmp %l, %r\n  setne al\n  movzx %0, al"},
+  {ND_NE, NT_REG, NT_IMM, NT_MEM, 3, "cmp %r, %l\n  setne al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_REG, NT_REG, 3, "cmp %0, %r\n  setl al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_REG, NT_IMM, 3, "cmp %0, %r\n  setl al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_REG, NT_MEM, 3, "cmp %0, %r\n  setl al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_IMM, NT_REG, 3, "cmp %0, %l\n  setg al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_MEM, NT_REG, 3, "cmp %0, %l\n  setg al\n  movzx %0, al", rhs_pure},
+  {ND_LT, NT_REG, NT_MEM, NT_IMM, 3, "cmp %l, %r\n  setl al\n  movzx %0, al"},
+  {ND_LT, NT_REG, NT_IMM, NT_MEM, 3, "cmp %r, %l\n  setg al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_REG, NT_REG, 3, "cmp %0, %r\n  setle al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_REG, NT_IMM, 3, "cmp %0, %r\n  setle al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_REG, NT_MEM, 3, "cmp %0, %r\n  setle al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_IMM, NT_REG, 3, "cmp %0, %l\n  setge al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_MEM, NT_REG, 3, "cmp %0, %l\n  setge al\n  movzx %0, al", rhs_pure},
+  {ND_LE, NT_REG, NT_MEM, NT_IMM, 3, "cmp %l, %r\n  setle al\n  movzx %0, al"},
+  {ND_LE, NT_REG, NT_IMM, NT_MEM, 3, "cmp %r, %l\n  setge al\n  movzx %0, al"},
+};
+
+#define NRULES (sizeof(rules) / sizeof(*rules))
+
+static int child_cost(Node *node, NonTerm nt) {
+  if (nt == NT_NONE)
+    return 0;
+  if (!node)
+    return INF;
+  return node->label->cost[nt];
 }
 
-static void load(void){
-  printf("  mov %s, [%s]\n", reg(top - 1), reg(top - 1));
+// 条件式 (cond ? then : els) は木の形が違うので表ではなく個別に扱う。
+// thenとelsを両方計算してからcmpし，条件が偽ならcmovでelsに置き換える。
+static Rule cond_rule = {ND_COND, NT_REG, NT_NONE, NT_NONE, 2};
+
+// ntsのうち最もコストの低い非終端記号
+static NonTerm cheapest(Node *node, NonTerm *nts, int n) {
+  NonTerm best = nts[0];
+  for (int i = 1; i < n; i++)
+    if (node->label->cost[nts[i]] < node->label->cost[best])
+      best = nts[i];
+  return best;
 }
 
-static void store(void) {
-  printf("  mov [%s], %s\n", reg(top - 1), reg(top - 2));
-  top--;
+static NonTerm cmov_src[] = {NT_REG, NT_MEM}; // cmovのソースは即値にできない
+static NonTerm cmp_src[] = {NT_IMM, NT_MEM, NT_REG};
+
+static void label_cond(Node *node) {
+  Node *cmp = node->cond;
+  Node *els = node->els;
+  int cost = cond_rule.cost + node->then->label->cost[NT_REG] +
+    els->label->cost[cheapest(els, cmov_src, 2)] +
+    cmp->lhs->label->cost[NT_REG] +
+    cmp->rhs->label->cost[cheapest(cmp->rhs, cmp_src, 3)];
+
+  if (cost < INF) {
+    node->label->cost[NT_REG] = cost;
+    node->label->rule[NT_REG] = &cond_rule;
+  }
 }
 
-// static : 関数のスコープをファイルスコープにする
-static void gen_expr(Node *node){
-  switch (node->kind){
-  case ND_NUM:
-    printf("  mov %s, %lu\n", reg(top++), node->val);
-    return;
-  case ND_VAR:
-    gen_addr(node);
-    load();
+// 部分木の各非終端記号について最小コストの規則を求める
+static void label(Node *node) {
+  if (!node || node->label)
     return;
-  case ND_ASSIGN:
-    gen_expr(node->rhs);
-    gen_addr(node->lhs);
-    store();
+  label(node->lhs);
+  label(node->rhs);
+  label(node->cond);
+  label(node->then);
+  label(node->els);
+
+  struct Label *lb = arena_calloc(1, sizeof(struct Label));
+  for (int i = 0; i < NT_MAX; i++)
+    lb->cost[i] = INF;
+  node->label = lb;
+
+  if (node->kind == ND_COND) {
+    label_cond(node);
     return;
   }
-  
-  gen_expr(node->lhs);
-  gen_expr(node->rhs);
 
-  char *rd = reg(top - 2);
-  char *rs = reg(top - 1);
-  top--;
+  for (Rule *r = rules; r < rules + NRULES; r++) {
+    if (r->kind != node->kind || (r->pred && !r->pred(node)))
+      continue;
+    int lc = child_cost(node->lhs, r->l);
+    int rc = child_cost(node->rhs, r->r);
+    if (lc >= INF || rc >= INF)
+      continue;
+    int cost = r->cost + lc + rc;
+    if (cost < lb->cost[r->nt]) {
+      lb->cost[r->nt] = cost;
+      lb->rule[r->nt] = r;
+    }
+  }
 
-  switch (node->kind){
-  case ND_ADD:
-    printf("  add %s, %s\n", rd, rs);
-    return;
-  case ND_SUB:
-    printf("  sub %s, %s\n", rd, rs);
-    return;
-  case ND_MUL:
-    printf("  imul %s, %s\n", rd, rs);
-    return;
-  case ND_DIV:
-    printf("  mov rax, %s\n", rd);
-    printf("  cqo\n"); // RAXの64bitを128bitに伸ばし，RDXとRAXにセット
-    printf("  idiv %s\n", rs); // 引数のレジスタの64bitで割る
-    printf("  mov %s, rax\n", rd);
-    return;
-  case ND_EQ:
-    printf("  cmp %s, %s\n", rd, rs); // 比較結果はフラグレジスタに挿入
-    printf("  sete al\n"); // 比較結果をsete命令でalレジスタに代入
-    // ALはRAXの下位8ビット
-    printf("  movzx %s, al\n", rd); // movzx命令はRAXの上位56ビットをゼロクリア
-    return;
-  case ND_NE:
-    printf("  cmp %s, %s\n", rd, rs);
-    printf("  setne al\n");
-    printf("  movzx %s, al\n", rd); 
-    return;
-  case ND_LT:
-    printf("  cmp %s, %s\n", rd, rs);
-    printf("  setl al\n");
-    printf("  movzx %s, al\n", rd); 
+  // 連鎖規則はコストが下がらなくなるまで適用する
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Rule *r = rules; r < rules + NRULES; r++) {
+      if (r->kind != CHAIN)
+        continue;
+      int cost = r->cost + lb->cost[r->l];
+      if (cost < lb->cost[r->nt]) {
+        lb->cost[r->nt] = cost;
+        lb->rule[r->nt] = r;
+        changed = true;
+      }
+    }
+  }
+}
+
+static char *format_operand(char *buf, Operand *op) {
+  switch (op->nt) {
+  case NT_REG:
+    return buf + sprintf(buf, "%s", reg(op->base));
+  case NT_IMM:
+  case NT_SCALE:
+  case NT_SCALE3:
+    return buf + sprintf(buf, "%ld", op->disp);
+  case NT_MEM:
+    return buf + sprintf(buf, "QWORD PTR [rbp-%ld]", op->disp);
+  }
+
+  // アドレス
+  char *p = buf;
+  p += sprintf(p, "[");
+  if (op->base >= 0)
+    p += sprintf(p, "%s", reg(op->base));
+  if (op->index >= 0)
+    p += sprintf(p, "%s%s*%d", op->base >= 0 ? "+" : "", reg(op->index), op->scale);
+  if (op->disp)
+    p += sprintf(p, "%+ld", op->disp);
+  return p + sprintf(p, "]");
+}
+
+static int lowest_reg(Operand *op, int r) {
+  if (op->base >= 0 && op->base < r)
+    r = op->base;
+  if (op->index >= 0 && op->index < r)
+    r = op->index;
+  return r;
+}
+
+static void reduce(Node *node, NonTerm nt, Operand *op);
+
+static void reduce_cond(Node *node, Operand *op) {
+  Node *cmp = node->cond;
+  Operand t, e, l, r;
+  reduce(node->then, NT_REG, &t);
+  reduce(node->els, cheapest(node->els, cmov_src, 2), &e);
+  reduce(cmp->lhs, NT_REG, &l);
+  reduce(cmp->rhs, cheapest(cmp->rhs, cmp_src, 3), &r);
+
+  // 条件が偽のときにelsを選ぶ
+  char *cc;
+  switch (cmp->kind) {
+  case ND_EQ: cc = "ne"; break;
+  case ND_NE: cc = "e"; break;
+  case ND_LT: cc = "ge"; break;
+  case ND_LE: cc = "g"; break;
+  default: error("invalid condition");
+  }
+
+  char lbuf[64], rbuf[64], ebuf[64];
+  format_operand(lbuf, &l);
+  format_operand(rbuf, &r);
+  format_operand(ebuf, &e);
+  emit("cmp %s, %s", lbuf, rbuf);
+  emit("cmov%s %s, %s", cc, reg(t.base), ebuf);
+
+  top = t.base + 1;
+  *op = (Operand){NT_REG, t.base, -1};
+}
+
+// 選ばれた規則に従って命令を出力する
+static void reduce(Node *node, NonTerm nt, Operand *op) {
+  if (node->kind == ND_COND) {
+    reduce_cond(node, op);
     return;
-  case ND_LE:
-    printf("  cmp %s, %s\n", rd, rs);
-    printf("  setle al\n");
-    printf("  movzx %s, al\n", rd); 
+  }
+
+  Rule *rule = node->label->rule[nt];
+  Operand l = {NT_NONE, -1, -1};
+  Operand r = {NT_NONE, -1, -1};
+
+  if (rule->kind == CHAIN) {
+    reduce(node, rule->l, &l);
+  } else if (rule->l == NT_NONE) {
+    // 葉
+    l.nt = node->kind == ND_VAR ? NT_MEM : NT_IMM;
+    l.disp = node->kind == ND_VAR ? node->var->offset : node->val;
+  } else {
+    reduce(node->lhs, rule->l, &l);
+    if (rule->r != NT_NONE)
+      reduce(node->rhs, rule->r, &r);
+  }
+
+  *op = (Operand){nt, -1, -1};
+  if (!rule->tmpl) {
+    rule->build(op, &l, &r);
     return;
-  default:
-    error("invalid statement");
   }
+
+  // 結果はオペランドのうち一番下のレジスタに置き，それより上は解放する
+  int dst = lowest_reg(&r, lowest_reg(&l, top));
+  if (dst == top)
+    reg(top);
+  top = dst + 1;
+  op->base = dst;
+
+  char buf[256];
+  char *p = buf;
+  for (char *t = rule->tmpl; *t; t++) {
+    if (*t != '%') {
+      *p++ = *t;
+      continue;
+    }
+    t++;
+    if (*t == '0')
+      p += sprintf(p, "%s", reg(dst));
+    else if (*t == 'l')
+      p = format_operand(p, &l);
+    else
+      p = format_operand(p, &r);
+  }
+  *p = '\0';
+  emit("%s", buf);
+}
+
+// 式の値を計算し，新しいレジスタreg(top++)に置く
+static void gen_expr(Node *node){
+  label(node);
+  if (node->label->cost[NT_REG] >= INF) {
+    if (node->kind == ND_ASSIGN)
+      error("not an lvalue");
+    error("invalid expression");
+  }
+
+  Operand op;
+  int sp = top;
+  reduce(node, NT_REG, &op);
+  assert(op.base == sp && top == sp + 1);
 }
 
 static void gen_stmt(Node *node) {
@@ -101,20 +495,20 @@ static void gen_stmt(Node *node) {
     int seq = labelseq++; // 制御文の出現回数
     if (node->els){ // if(A) B else C
       gen_expr(node->cond); // Aをコンパイルしたコード // スタックのトップからpopしたデータを利用
-      printf("  cmp %s, 0\n", reg(--top));
-      printf("  je .L.else.%d\n", seq);
+      emit("cmp %s, 0", reg(--top));
+      emit("je .L.else.%d", seq);
       gen_stmt(node->then); // Bをコンパイルしたコード
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.else.%d:\n", seq);
+      emit("jmp .L.end.%d", seq);
+      emit(".L.else.%d:", seq);
       gen_stmt(node->els); // Cをコンパイルしたコード
-      printf(".L.end.%d:\n", seq);
+      emit(".L.end.%d:", seq);
     }
     else { // if (A) B
       gen_expr(node->cond); // Aをコンパイルしたコード // スタックのトップからpopしたデータを利用
-      printf("  cmp %s, 0\n", reg(--top));
-      printf("  je .L.end.%d\n", seq);
+      emit("cmp %s, 0", reg(--top));
+      emit("je .L.end.%d", seq);
       gen_stmt(node->then); // Bをコンパイルしたコード
-      printf(".L.end.%d:\n", seq);
+      emit(".L.end.%d:", seq);
     }
     return;
   }
@@ -122,17 +516,17 @@ static void gen_stmt(Node *node) {
     int seq = labelseq++; // 制御文の出現回数
     if (node->init) // for (A;B;C) D
       gen_stmt(node->init); // Aをコンパイルしたコード
-    printf(".L.begin.%d:\n", seq);
+    emit(".L.begin.%d:", seq);
     if (node->cond) {
       gen_expr(node->cond); // Bをコンパイルしたコード // スタックのトップからpopしたデータを利用
-      printf("  cmp %s, 0\n", reg(--top));
-      printf("  je .L.end.%d\n", seq);      
+      emit("cmp %s, 0", reg(--top));
+      emit("je .L.end.%d", seq);      
     }
     gen_stmt(node->then); // Dをコンパイルしたコード
     if (node->inc)
       gen_stmt(node->inc); // Cをコンパイルしたコード (インクリメントの分)
-    printf("  jmp .L.begin.%d\n", seq);
-    printf(".L.end.%d:\n", seq);
+    emit("jmp .L.begin.%d", seq);
+    emit(".L.end.%d:", seq);
     return;
   }
   case ND_BLOCK: // stmt =  "{" stmt* "}"
@@ -142,8 +536,8 @@ static void gen_stmt(Node *node) {
     return;
   case ND_RETURN:
     gen_expr(node->lhs);
-    printf("  mov rax, %s\n", reg(--top));
-    printf("  jmp .L.return\n");    
+    emit("mov rax, %s", reg(--top));
+    emit("jmp .L.return");    
     return;
   case ND_EXPR_STMT:
     gen_expr(node->lhs);
@@ -155,20 +549,23 @@ static void gen_stmt(Node *node) {
 }
 
 
+// ASTから命令列prog->insnsを作る
 void codegen(Function *prog) {
-  // 最初の3行
-  printf(".intel_syntax noprefix \n"); // intel記法の選択
-  printf(".global main\n"); // プログラム全体から見える関数の指定
-  printf("main:\n");
+  top = 0;
+  labelseq = 1;
+  prog->insns = NULL;
+  insn_tail = &prog->insns;
+
+  emit("main:");
 
   // Prologue. r12-15 : callee-saved レジスタ
-  printf("  push rbp\n");
-  printf("  mov rbp, rsp\n");
-  printf("  sub rsp, %d\n", prog->stack_size);
-  printf("  mov [rbp-8], r12\n");
-  printf("  mov [rbp-16], r13\n");
-  printf("  mov [rbp-24], r14\n");
-  printf("  mov [rbp-32], r15\n");
+  emit("push rbp");
+  emit("mov rbp, rsp");
+  emit("sub rsp, %d", prog->stack_size);
+  emit("mov [rbp-8], r12");
+  emit("mov [rbp-16], r13");
+  emit("mov [rbp-24], r14");
+  emit("mov [rbp-32], r15");
 
   // 走査
   for (Node *n = prog->node; n; n = n->next){
@@ -177,12 +574,29 @@ void codegen(Function *prog) {
   }
 
   // Epilogue
-  printf(".L.return:\n");
-  printf("  mov r12, [rbp-8]\n");
-  printf("  mov r13, [rbp-16]\n");
-  printf("  mov r14, [rbp-24]\n");
-  printf("  mov r15, [rbp-32]\n");
-  printf("  mov rsp, rbp\n");
-  printf("  pop rbp\n");
-  printf("  ret\n");
+  emit(".L.return:");
+  emit("mov r12, [rbp-8]");
+  emit("mov r13, [rbp-16]");
+  emit("mov r14, [rbp-24]");
+  emit("mov r15, [rbp-32]");
+  emit("mov rsp, rbp");
+  emit("pop rbp");
+  emit("ret");
+}
+
+// 命令列をアセンブリとして出力する
+void emit_asm(Function *prog) {
+  printf(".intel_syntax noprefix \n"); // intel記法の選択
+  printf(".global main\n"); // プログラム全体から見える関数の指定
+
+  for (Insn *insn = prog->insns; insn; insn = insn->next) {
+    if (insn->label) {
+      printf("%s:\n", insn->label);
+      continue;
+    }
+    printf("  %s", insn->op);
+    for (int i = 0; i < insn->nopnd; i++)
+      printf("%s%s", i ? ", " : " ", insn->opnd[i]);
+    printf("\n");
+  }
 }
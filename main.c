@@ -4,13 +4,79 @@ static int align_to(int n, int align) {
   return (n + align - 1) & ~(align - 1);
 }
 
-int main(int argc, char **argv){
-  if (argc != 2)
-    error("%s: 引数の個数が正しくありません", argv[0]);
+static void usage(char *argv0) {
+  error("使い方: %s [-O0|-O1|-O2] [-f<pass>|-fno-<pass>] [-fprofile-use=<file>] [-mtune=<cpu>] [-ftime-report] <program>\n"
+        "       %s --server <socket> [-j<workers>]", argv0, argv0);
+}
+
+// コマンドライン引数を解釈し，コンパイルするプログラムを返す
+// 前回の呼び出しで設定したオプションは既定値に戻す
+char *parse_args(int argc, char **argv) {
+  char *input = NULL;
+  opt_reset();
+  sched_set_model(NULL);
+
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (!strcmp(arg, "-O")) {
+      opt_set_level(1);
+      continue;
+    }
+
+    if (!strncmp(arg, "-O", 2)) {
+      if (strlen(arg) != 3 || arg[2] < '0' || '2' < arg[2])
+        error("不明な最適化レベルです: %s", arg);
+      opt_set_level(arg[2] - '0');
+      continue;
+    }
+
+    if (!strncmp(arg, "-mtune=", 7)) {
+      sched_set_model(arg + 7);
+      continue;
+    }
+
+    if (!strcmp(arg, "-ftime-report")) {
+      time_report = true;
+      continue;
+    }
+
+    if (!strncmp(arg, "-fprofile-use=", 14)) {
+      opt_set_profile(arg + 14);
+      continue;
+    }
+
+    if (!strncmp(arg, "-fno-", 5)) {
+      opt_set_pass(arg + 5, false);
+      continue;
+    }
+
+    if (!strncmp(arg, "-f", 2)) {
+      opt_set_pass(arg + 2, true);
+      continue;
+    }
 
-  Token *tok = tokenize(argv[1]);
+    if (arg[0] == '-')
+      usage(argv[0]);
+
+    if (input)
+      error("%s: 引数の個数が正しくありません", argv[0]);
+    input = arg;
+  }
+
+  if (!input)
+    usage(argv[0]);
+  return input;
+}
+
+// inputをコンパイルしてアセンブリを標準出力に書く
+void compile(char *input) {
+  Token *tok = tokenize(input);
   Function *prog = parse(tok);
 
+  // -Oレベルに応じた最適化パスを実行
+  run_passes(prog, PASS_AST);
+
   // ローカル変数にoffsetを与える
   int offset = 32; // callee-savedレジスタを考慮
   for (Var *var = prog->locals; var; var = var->next) {
@@ -21,7 +87,14 @@ int main(int argc, char **argv){
 
   // Traverse the AST to emit assembly.
   codegen(prog);
+  run_passes(prog, PASS_INSN);
+  emit_asm(prog);
+}
 
+int main(int argc, char **argv){
+  if (argc >= 2 && !strcmp(argv[1], "--server"))
+    return server_main(argc, argv);
+
+  compile(parse_args(argc, argv));
   return 0;
 }
-
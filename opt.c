@@ -0,0 +1,738 @@
+#include "9cc.h"
+
+// パスマネージャ
+// parse()とcodegen()の間でASTを書き換えるパスと，codegen()が作った命令列を
+// 書き換えるパスを登録し，-Oレベルと-f<pass>/-fno-<pass>で選ばれたものを
+// 依存関係の順に実行する。依存は順序だけを決めるもので，依存先が無効なら
+// そのまま実行する (依存先で畳み込んでおいた方がよく効くというだけ)
+
+typedef struct Pass Pass;
+struct Pass {
+  char *name; // -f<name>, -fno-<name>で指定する名前
+  PassStage stage; // 対象とするIR
+  int level; // このレベル以上の-Oで有効になる
+  char *deps[4]; // 有効なら先に実行しておくパス (NULL終端)
+  int (*run)(Function *prog); // 書き換えた回数を返す
+  int force; // 1: -fで有効, -1: -fnoで無効, 0: -Oレベルに従う
+};
+
+static int fold(Function *prog);
+static int simplify(Function *prog);
+static int dce(Function *prog);
+static int ifcvt(Function *prog);
+
+static Pass passes[] = {
+  {"fold", PASS_AST, 1, {NULL}, fold},
+  {"simplify", PASS_AST, 2, {"fold", NULL}, simplify},
+  {"dce", PASS_AST, 1, {"fold", NULL}, dce},
+  {"ifcvt", PASS_AST, 2, {NULL}, ifcvt},
+  {"sched", PASS_INSN, 2, {NULL}, schedule},
+};
+
+#define NPASSES (sizeof(passes) / sizeof(*passes))
+#define MAX(x, y) ((x) < (y) ? (y) : (x))
+
+static int opt_level = 0;
+static char *profile_path;
+bool time_report;
+
+// 設定を既定値に戻す
+void opt_reset(void) {
+  opt_level = 0;
+  profile_path = NULL;
+  time_report = false;
+  for (int i = 0; i < NPASSES; i++)
+    passes[i].force = 0;
+}
+
+void opt_set_level(int level) {
+  opt_level = level;
+}
+
+void opt_set_profile(char *path) {
+  profile_path = path;
+}
+
+static Pass *find_pass(char *name) {
+  for (int i = 0; i < NPASSES; i++)
+    if (!strcmp(passes[i].name, name))
+      return &passes[i];
+  return NULL;
+}
+
+void opt_set_pass(char *name, bool enable) {
+  Pass *pass = find_pass(name);
+  if (!pass)
+    error("不明な最適化パスです: %s", name);
+  pass->force = enable ? 1 : -1;
+}
+
+static bool is_enabled(Pass *pass) {
+  if (pass->force)
+    return pass->force > 0;
+  return pass->level <= opt_level;
+}
+
+//
+// ユーティリティ
+//
+
+// 代入を含む式は評価を省略できない
+bool has_side_effect(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_ASSIGN)
+    return true;
+  return has_side_effect(node->lhs) || has_side_effect(node->rhs) ||
+    has_side_effect(node->cond) || has_side_effect(node->then) ||
+    has_side_effect(node->els);
+}
+
+static bool is_num(Node *node, long val) {
+  return node->kind == ND_NUM && node->val == val;
+}
+
+// nodeをsrcの内容で置き換える (nextは保つ)
+static void replace(Node *node, Node *src) {
+  Node *next = node->next;
+  *node = *src;
+  node->next = next;
+}
+
+static void set_num(Node *node, long val) {
+  Node *next = node->next;
+  memset(node, 0, sizeof(Node));
+  node->kind = ND_NUM;
+  node->val = val;
+  node->next = next;
+}
+
+static void set_empty(Node *node) {
+  Node *next = node->next;
+  memset(node, 0, sizeof(Node));
+  node->kind = ND_BLOCK;
+  node->next = next;
+}
+
+// 文と式を全て訪問し，式にはfnを後行順で適用する
+static int walk_expr(Node *node, int (*fn)(Node *node)) {
+  if (!node)
+    return 0;
+
+  int n = 0;
+  switch (node->kind) {
+  case ND_IF:
+  case ND_FOR:
+    n += walk_expr(node->init, fn);
+    n += walk_expr(node->cond, fn);
+    n += walk_expr(node->inc, fn);
+    n += walk_expr(node->then, fn);
+    n += walk_expr(node->els, fn);
+    return n;
+  case ND_BLOCK:
+    for (Node *n2 = node->body; n2; n2 = n2->next)
+      n += walk_expr(n2, fn);
+    return n;
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    return walk_expr(node->lhs, fn);
+  case ND_COND:
+    n += walk_expr(node->cond, fn);
+    n += walk_expr(node->then, fn);
+    n += walk_expr(node->els, fn);
+    return n + fn(node);
+  }
+
+  n += walk_expr(node->lhs, fn);
+  n += walk_expr(node->rhs, fn);
+  return n + fn(node);
+}
+
+static int walk_prog(Function *prog, int (*fn)(Node *node)) {
+  int n = 0;
+  for (Node *node = prog->node; node; node = node->next)
+    n += walk_expr(node, fn);
+  return n;
+}
+
+//
+// fold: 定数畳み込み
+//
+
+static bool eval_binary(NodeKind kind, long l, long r, long *val) {
+  // 符号付きのオーバーフローは未定義動作なので符号なしで計算する
+  switch (kind) {
+  case ND_ADD: *val = (unsigned long)l + r; return true;
+  case ND_SUB: *val = (unsigned long)l - r; return true;
+  case ND_MUL: *val = (unsigned long)l * r; return true;
+  case ND_DIV:
+    // idivが例外を起こすものは実行時に任せる
+    if (r == 0 || (l == LONG_MIN && r == -1))
+      return false;
+    *val = l / r;
+    return true;
+  case ND_EQ: *val = l == r; return true;
+  case ND_NE: *val = l != r; return true;
+  case ND_LT: *val = l < r; return true;
+  case ND_LE: *val = l <= r; return true;
+  default:
+    return false;
+  }
+}
+
+static int fold_node(Node *node) {
+  if (node->kind == ND_COND && node->cond->kind == ND_NUM) {
+    replace(node, node->cond->val ? node->then : node->els);
+    return 1;
+  }
+
+  if (!node->lhs || !node->rhs || node->kind == ND_ASSIGN)
+    return 0;
+  if (node->lhs->kind != ND_NUM || node->rhs->kind != ND_NUM)
+    return 0;
+
+  long val;
+  if (!eval_binary(node->kind, node->lhs->val, node->rhs->val, &val))
+    return 0;
+  set_num(node, val);
+  return 1;
+}
+
+static int fold(Function *prog) {
+  return walk_prog(prog, fold_node);
+}
+
+//
+// simplify: 単位元・零元による代数的簡約
+//
+
+static int simplify_node(Node *node) {
+  Node *l = node->lhs;
+  Node *r = node->rhs;
+
+  switch (node->kind) {
+  case ND_ADD:
+    if (is_num(r, 0)) { replace(node, l); return 1; } // x+0
+    if (is_num(l, 0)) { replace(node, r); return 1; } // 0+x
+    return 0;
+  case ND_SUB:
+    if (is_num(r, 0)) { replace(node, l); return 1; } // x-0
+    return 0;
+  case ND_MUL:
+    if (is_num(r, 1)) { replace(node, l); return 1; } // x*1
+    if (is_num(l, 1)) { replace(node, r); return 1; } // 1*x
+    if ((is_num(r, 0) && !has_side_effect(l)) ||
+        (is_num(l, 0) && !has_side_effect(r))) { // x*0, 0*x
+      set_num(node, 0);
+      return 1;
+    }
+    return 0;
+  case ND_DIV:
+    if (is_num(r, 1)) { replace(node, l); return 1; } // x/1
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+static int simplify(Function *prog) {
+  return walk_prog(prog, simplify_node);
+}
+
+//
+// dce: 到達しない文・効果のない文の削除
+//
+
+static int dce_stmt(Node *node);
+
+// 文のリストを走査し，returnより後ろの文と効果のない式文を取り除く
+static int dce_list(Node **list) {
+  int n = 0;
+  for (Node **cur = list; *cur; ) {
+    Node *node = *cur;
+    n += dce_stmt(node);
+
+    if (node->kind == ND_EXPR_STMT && !has_side_effect(node->lhs)) {
+      *cur = node->next;
+      n++;
+      continue;
+    }
+    if (node->kind == ND_BLOCK && !node->body) {
+      *cur = node->next;
+      n++;
+      continue;
+    }
+    if (node->kind == ND_RETURN && node->next) {
+      node->next = NULL;
+      n++;
+    }
+    cur = &node->next;
+  }
+  return n;
+}
+
+static int dce_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_IF: {
+    int n = dce_stmt(node->then);
+    if (node->els)
+      n += dce_stmt(node->els);
+
+    // 条件が定数なら分岐を取り除く
+    if (node->cond->kind == ND_NUM) {
+      if (node->cond->val)
+        replace(node, node->then);
+      else if (node->els)
+        replace(node, node->els);
+      else
+        set_empty(node);
+      return n + 1;
+    }
+    return n;
+  }
+  case ND_FOR: {
+    int n = dce_stmt(node->then);
+
+    // 一度も実行されないループは初期化だけ残す
+    if (node->cond && is_num(node->cond, 0)) {
+      if (node->init)
+        replace(node, node->init);
+      else
+        set_empty(node);
+      return n + 1;
+    }
+    return n;
+  }
+  case ND_BLOCK:
+    return dce_list(&node->body);
+  default:
+    return 0;
+  }
+}
+
+static int dce(Function *prog) {
+  return dce_list(&prog->node);
+}
+
+//
+// ifcvt: 単純な代入やreturnだけのif文を分岐のない条件式にする
+//
+// if (c) x = a; else x = b;  =>  x = c ? a : b;  (cmp + cmov)
+// if (c) return a; else return b;  =>  return c ? a : b;
+// if (c) x = x + k;  =>  x = x + (c)*k;  (setcc)
+//
+
+// 両方の腕を必ず評価することになるので，これより重い腕は変換しない
+#define IFCVT_MAX_COST 6
+
+// プロファイルでこれ以上偏っている分岐は予測が当たるので残す
+#define IFCVT_PREDICTABLE 0.9
+
+// branch_idごとの[成立した回数, 成立しなかった回数]
+static long (*profile)[2];
+static int profile_len;
+
+// プロファイルは1行に1つのif文について "branch_id 成立回数 不成立回数" を書く。
+// branch_idはソース中のif文の0から始まる通し番号
+static void read_profile(void) {
+  profile = NULL;
+  profile_len = 0;
+  if (!profile_path)
+    return;
+
+  FILE *fp = fopen(profile_path, "r");
+  if (!fp)
+    error("プロファイルを開けません: %s", profile_path);
+
+  int id;
+  long taken, not_taken;
+  while (fscanf(fp, "%d %ld %ld", &id, &taken, &not_taken) == 3) {
+    if (id < 0)
+      continue;
+    if (id >= profile_len) {
+      profile = realloc(profile, sizeof(*profile) * (id + 1));
+      memset(profile + profile_len, 0, sizeof(*profile) * (id + 1 - profile_len));
+      profile_len = id + 1;
+    }
+    profile[id][0] = taken;
+    profile[id][1] = not_taken;
+  }
+  fclose(fp);
+}
+
+static bool is_predictable(Node *node) {
+  if (node->branch_id >= profile_len)
+    return false;
+  long taken = profile[node->branch_id][0];
+  long not_taken = profile[node->branch_id][1];
+  long total = taken + not_taken;
+  if (total == 0)
+    return false;
+  return (taken > not_taken ? taken : not_taken) >= IFCVT_PREDICTABLE * total;
+}
+
+// 投機的に評価すると例外を起こしうる (0除算，LONG_MIN / -1)
+static bool may_trap(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_DIV &&
+      (node->rhs->kind != ND_NUM || node->rhs->val == 0 || node->rhs->val == -1))
+    return true;
+  return may_trap(node->lhs) || may_trap(node->rhs) ||
+    may_trap(node->cond) || may_trap(node->then) || may_trap(node->els);
+}
+
+// 式を評価するおおよその命令数
+static int expr_cost(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    return 0;
+  case ND_VAR:
+    return 1;
+  case ND_MUL:
+    return 3 + expr_cost(node->lhs) + expr_cost(node->rhs);
+  case ND_DIV:
+    return 20 + expr_cost(node->lhs) + expr_cost(node->rhs);
+  case ND_COND:
+    return 2 + expr_cost(node->cond) + expr_cost(node->then) + expr_cost(node->els);
+  default:
+    return 1 + expr_cost(node->lhs) + expr_cost(node->rhs);
+  }
+}
+
+// 式を評価するのに使うレジスタの数の上限
+// 命令選択は左の子から評価し，結果は最大2つのレジスタ (base + index) に
+// 置かれるので，右の子を評価する間は左の分として2つを見込む。
+// 条件式はthen，els，比較の左辺を順にレジスタに置いたまま比較の右辺を評価する
+static int reg_need(Node *node) {
+  if (!node)
+    return 0;
+  if (node->kind == ND_COND) {
+    Node *cmp = node->cond;
+    int n = reg_need(node->then);
+    n = MAX(n, 1 + reg_need(node->els));
+    n = MAX(n, 2 + reg_need(cmp->lhs));
+    return MAX(n, 3 + reg_need(cmp->rhs));
+  }
+  if (!node->lhs)
+    return 1;
+  return MAX(reg_need(node->lhs), 2 + reg_need(node->rhs));
+}
+
+static bool is_compare(Node *node) {
+  return node->kind == ND_EQ || node->kind == ND_NE ||
+    node->kind == ND_LT || node->kind == ND_LE;
+}
+
+static bool can_speculate(Node *then, Node *els) {
+  return !has_side_effect(then) && !has_side_effect(els) &&
+    !may_trap(then) && !may_trap(els) &&
+    expr_cost(then) + expr_cost(els) <= IFCVT_MAX_COST;
+}
+
+static Node *new_expr(NodeKind kind, Node *lhs, Node *rhs) {
+  Node *node = arena_calloc(1, sizeof(Node));
+  node->kind = kind;
+  node->lhs = lhs;
+  node->rhs = rhs;
+  return node;
+}
+
+static Node *new_num(long val) {
+  Node *node = new_expr(ND_NUM, NULL, NULL);
+  node->val = val;
+  return node;
+}
+
+// 同じノードを木の2箇所から指すと，片方を書き換えたときにもう片方も変わる
+// ので，変数を式の中でも使うときは別のノードにする
+static Node *new_var(Var *var) {
+  Node *node = new_expr(ND_VAR, NULL, NULL);
+  node->var = var;
+  return node;
+}
+
+// { stmt } をstmtにする
+static Node *single_stmt(Node *node) {
+  while (node && node->kind == ND_BLOCK && node->body && !node->body->next)
+    node = node->body;
+  return node;
+}
+
+static Node *assign_of(Node *stmt) {
+  if (stmt && stmt->kind == ND_EXPR_STMT && stmt->lhs->kind == ND_ASSIGN)
+    return stmt->lhs;
+  return NULL;
+}
+
+static bool same_var(Node *a, Node *b) {
+  return a->kind == ND_VAR && b->kind == ND_VAR && a->var == b->var;
+}
+
+// x + k, k + x, x - k のkを返す
+static Node *increment_of(Node *expr, Node *var, NodeKind *kind) {
+  *kind = expr->kind;
+  if (expr->kind == ND_ADD && same_var(expr->lhs, var) && expr->rhs->kind == ND_NUM)
+    return expr->rhs;
+  if (expr->kind == ND_ADD && same_var(expr->rhs, var) && expr->lhs->kind == ND_NUM)
+    return expr->lhs;
+  if (expr->kind == ND_SUB && same_var(expr->lhs, var) && expr->rhs->kind == ND_NUM)
+    return expr->rhs;
+  return NULL;
+}
+
+// 比較でない条件はc != 0にして，cmpの結果のフラグを使えるようにする
+static Node *new_cond(Node *cond, Node *then, Node *els) {
+  if (!is_compare(cond))
+    cond = new_expr(ND_NE, cond, new_num(0));
+
+  // 0か1を選ぶだけなら比較の結果 (setcc) そのもの
+  if (is_num(then, 1) && is_num(els, 0))
+    return cond;
+
+  Node *node = new_expr(ND_COND, NULL, NULL);
+  node->cond = cond;
+  node->then = then;
+  node->els = els;
+  return node;
+}
+
+static void set_stmt(Node *node, NodeKind kind, Node *expr) {
+  Node *next = node->next;
+  memset(node, 0, sizeof(Node));
+  node->kind = kind;
+  node->lhs = expr;
+  node->next = next;
+}
+
+static bool convert_if(Node *node) {
+  if (has_side_effect(node->cond) || is_predictable(node))
+    return false;
+
+  Node *then = single_stmt(node->then);
+  Node *els = single_stmt(node->els);
+
+  // if (c) return a; else return b;
+  if (then->kind == ND_RETURN && els && els->kind == ND_RETURN) {
+    if (!can_speculate(then->lhs, els->lhs))
+      return false;
+    Node *expr = new_cond(node->cond, then->lhs, els->lhs);
+    if (reg_need(expr) > NREGS)
+      return false;
+    set_stmt(node, ND_RETURN, expr);
+    return true;
+  }
+
+  Node *assign = assign_of(then);
+  if (!assign)
+    return false;
+  Node *var = assign->lhs;
+
+  // if (c) x = a; else x = b;
+  if (els) {
+    Node *assign2 = assign_of(els);
+    if (!assign2 || !same_var(var, assign2->lhs) ||
+        !can_speculate(assign->rhs, assign2->rhs))
+      return false;
+    Node *expr = new_cond(node->cond, assign->rhs, assign2->rhs);
+    if (reg_need(expr) > NREGS)
+      return false;
+    set_stmt(node, ND_EXPR_STMT, new_expr(ND_ASSIGN, var, expr));
+    return true;
+  }
+
+  if (!can_speculate(assign->rhs, var))
+    return false;
+
+  // if (c) x = x + k; は比較の結果にkを掛けて足す
+  NodeKind kind;
+  Node *k = increment_of(assign->rhs, var, &kind);
+  if (k) {
+    Node *cond = new_cond(node->cond, new_num(1), new_num(0));
+    Node *expr = new_expr(kind, new_var(var->var), new_expr(ND_MUL, cond, k));
+    if (reg_need(expr) > NREGS)
+      return false;
+    set_stmt(node, ND_EXPR_STMT, new_expr(ND_ASSIGN, var, expr));
+    return true;
+  }
+
+  // if (c) x = a;
+  Node *expr = new_cond(node->cond, assign->rhs, new_var(var->var));
+  if (reg_need(expr) > NREGS)
+    return false;
+  set_stmt(node, ND_EXPR_STMT, new_expr(ND_ASSIGN, var, expr));
+  return true;
+}
+
+// 内側のif文から順に変換する
+static int ifcvt_stmt(Node *node) {
+  int n = 0;
+
+  switch (node->kind) {
+  case ND_IF:
+    n += ifcvt_stmt(node->then);
+    if (node->els)
+      n += ifcvt_stmt(node->els);
+    return n + convert_if(node);
+  case ND_FOR:
+    return ifcvt_stmt(node->then);
+  case ND_BLOCK:
+    for (Node *stmt = node->body; stmt; stmt = stmt->next)
+      n += ifcvt_stmt(stmt);
+    return n;
+  default:
+    return 0;
+  }
+}
+
+static int ifcvt(Function *prog) {
+  read_profile();
+
+  int n = 0;
+  for (Node *node = prog->node; node; node = node->next)
+    n += ifcvt_stmt(node);
+
+  free(profile);
+  profile = NULL;
+  profile_len = 0;
+  return n;
+}
+
+//
+// IRの検証 (デバッグビルドのみ)
+//
+
+#ifndef NDEBUG
+static void verify_expr(Pass *pass, Node *node) {
+  if (!node)
+    error("%s: 式がありません", pass->name);
+
+  switch (node->kind) {
+  case ND_NUM:
+    return;
+  case ND_VAR:
+    if (!node->var)
+      error("%s: 変数ノードに変数がありません", pass->name);
+    return;
+  case ND_ASSIGN:
+    if (!node->lhs || node->lhs->kind != ND_VAR)
+      error("%s: 代入の左辺が変数ではありません", pass->name);
+    verify_expr(pass, node->rhs);
+    return;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    verify_expr(pass, node->lhs);
+    verify_expr(pass, node->rhs);
+    return;
+  case ND_COND:
+    verify_expr(pass, node->cond);
+    verify_expr(pass, node->then);
+    verify_expr(pass, node->els);
+    return;
+  default:
+    error("%s: 式の位置に不正なノードがあります: %d", pass->name, node->kind);
+  }
+}
+
+static void verify_stmt(Pass *pass, Node *node) {
+  switch (node->kind) {
+  case ND_IF:
+    verify_expr(pass, node->cond);
+    verify_stmt(pass, node->then);
+    if (node->els)
+      verify_stmt(pass, node->els);
+    return;
+  case ND_FOR:
+    if (node->init)
+      verify_stmt(pass, node->init);
+    if (node->cond)
+      verify_expr(pass, node->cond);
+    if (node->inc)
+      verify_stmt(pass, node->inc);
+    verify_stmt(pass, node->then);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      verify_stmt(pass, n);
+    return;
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    verify_expr(pass, node->lhs);
+    return;
+  default:
+    error("%s: 文の位置に不正なノードがあります: %d", pass->name, node->kind);
+  }
+}
+
+static void verify_insns(Pass *pass, Function *prog) {
+  for (Insn *insn = prog->insns; insn; insn = insn->next) {
+    if (!insn->label == !insn->op)
+      error("%s: 命令とラベルのどちらでもない要素があります", pass->name);
+    for (int i = 0; i < insn->nopnd; i++)
+      if (!insn->opnd[i] || !*insn->opnd[i])
+        error("%s: %s のオペランドが空です", pass->name, insn->op);
+  }
+}
+
+static void verify(Pass *pass, Function *prog) {
+  if (pass->stage == PASS_INSN) {
+    verify_insns(pass, prog);
+    return;
+  }
+  for (Node *node = prog->node; node; node = node->next)
+    verify_stmt(pass, node);
+}
+#endif
+
+//
+// パスの実行
+//
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_pass(Function *prog, Pass *pass, bool *done) {
+  if (done[pass - passes])
+    return;
+  done[pass - passes] = true;
+
+  // 依存するパスが有効なら先に実行する
+  for (int i = 0; pass->deps[i]; i++) {
+    Pass *dep = find_pass(pass->deps[i]);
+    assert(dep && dep->stage == pass->stage);
+    if (is_enabled(dep))
+      run_pass(prog, dep, done);
+  }
+
+  double start = now();
+  int count = pass->run(prog);
+  double elapsed = now() - start;
+
+#ifndef NDEBUG
+  verify(pass, prog);
+#endif
+
+  if (time_report)
+    fprintf(stderr, "  %-12s %10.1f %10d\n", pass->name, elapsed * 1e6, count);
+}
+
+// stageを対象とする有効なパスを全て実行する
+void run_passes(Function *prog, PassStage stage) {
+  bool done[NPASSES] = {0};
+
+  if (time_report && stage == PASS_AST)
+    fprintf(stderr, "  %-12s %10s %10s\n", "pass", "time(us)", "rewrites");
+
+  for (int i = 0; i < NPASSES; i++)
+    if (passes[i].stage == stage && is_enabled(&passes[i]))
+      run_pass(prog, &passes[i], done);
+}
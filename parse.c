@@ -3,6 +3,9 @@
 // parse時に作られた全てのローカル変数はこの連結リストに格納
 Var *locals;
 
+// これまでに現れたif文の数
+static int branch_count;
+
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
 static Node *assign(Token **rest, Token *tok);
@@ -24,7 +27,7 @@ Var *find_var(Token *tok) {
 
 // 新しいノードの作成(符号，カッコ)
 static Node *new_node(NodeKind kind){
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_calloc(1, sizeof(Node));
   node->kind = kind;
   return node;
 }
@@ -58,7 +61,7 @@ static Node *new_var_node(Var *var){
 
 // 新しい変数は新しいlvarを作って新たなoffsetを作ってlocalsにセット
 static Var *new_lvar(char *name){
-  Var *var = calloc(1, sizeof(Var));
+  Var *var = arena_calloc(1, sizeof(Var));
   var->name = name;
   var->next = locals;
   locals = var;
@@ -90,6 +93,7 @@ static Node *stmt(Token **rest, Token *tok) {
   }
   if (equal(tok, "if")) { // if (A) B else C
     Node *node = new_node(ND_IF); 
+    node->branch_id = branch_count++;
     tok = skip(tok->next, "(");
     node->cond = expr(&tok, tok); // A
     tok = skip(tok, ")");
@@ -280,8 +284,8 @@ static Node *primary(Token **rest, Token *tok) {
   if (tok->kind == TK_IDENT){
     Var *var = find_var(tok);
     if (!var)
-      // strndupは文字列の複製
-      var = new_lvar(strndup(tok->loc, tok->len));
+      // arena_strndupは文字列の複製
+      var = new_lvar(arena_strndup(tok->loc, tok->len));
     *rest = tok->next;
     return new_var_node(var);
   }
@@ -293,9 +297,11 @@ static Node *primary(Token **rest, Token *tok) {
 
 // program = stmt*
 Function *parse(Token *tok) {
+  locals = NULL;
+  branch_count = 0;
   tok = skip(tok, "{");
 
-  Function *prog = calloc(1, sizeof(Function));
+  Function *prog = arena_calloc(1, sizeof(Function));
   prog->node = compound_stmt(&tok, tok)->body;
   prog->locals = locals;
   return prog;
@@ -0,0 +1,420 @@
+#include "9cc.h"
+
+// リストスケジューラ
+// codegenが作った命令列を基本ブロックごとに依存グラフにし，マシンモデルの
+// レイテンシと実行ポートを元に，クリティカルパスの長い命令から順に並べ直す。
+
+//
+// マシンモデル
+//
+
+#define NPORTS 8
+#define WINDOW 128 // 1度に並べ替える命令数の上限
+#define P(n) (1 << (n))
+#define MAX(x, y) ((x) < (y) ? (y) : (x))
+
+typedef struct {
+  char *op; // 命令名 (末尾が*なら前方一致)
+  int latency; // 結果が使えるようになるまでのサイクル数
+  int ports; // 実行できるポート
+  int busy; // ポートを占有するサイクル数 (パイプライン化されていない命令)
+} InsnModel;
+
+typedef struct {
+  char *name; // -mtune=で指定する名前
+  int width; // 1サイクルに発行できる命令数
+  int load_latency; // メモリオペランドを読むときに加わるレイテンシ
+  int store_forward; // ストアから同じアドレスのロードまでのレイテンシ
+  int lea3_latency; // base+index+dispの3要素のlea
+  int load_ports;
+  int store_ports;
+  InsnModel insns[16];
+} MachineModel;
+
+static MachineModel models[] = {
+  {
+    "skylake", 4, 5, 5, 3, P(2) | P(3), P(4),
+    {
+      {"mov", 1, P(0) | P(1) | P(5) | P(6)},
+      {"movzx", 1, P(0) | P(1) | P(5) | P(6)},
+      {"lea", 1, P(1) | P(5)},
+      {"add", 1, P(0) | P(1) | P(5) | P(6)},
+      {"sub", 1, P(0) | P(1) | P(5) | P(6)},
+      {"cmp", 1, P(0) | P(1) | P(5) | P(6)},
+      {"test", 1, P(0) | P(1) | P(5) | P(6)},
+      {"imul", 3, P(1)},
+      {"set*", 1, P(0) | P(6)},
+      {"cmov*", 1, P(0) | P(6)},
+      {"cqo", 1, P(0) | P(6)},
+      {"idiv", 42, P(0), 24},
+      {NULL},
+    },
+  },
+  {
+    "znver2", 5, 4, 4, 2, P(4) | P(5), P(6),
+    {
+      {"mov", 1, P(0) | P(1) | P(2) | P(3)},
+      {"movzx", 1, P(0) | P(1) | P(2) | P(3)},
+      {"lea", 1, P(0) | P(1) | P(2) | P(3)},
+      {"add", 1, P(0) | P(1) | P(2) | P(3)},
+      {"sub", 1, P(0) | P(1) | P(2) | P(3)},
+      {"cmp", 1, P(0) | P(1) | P(2) | P(3)},
+      {"test", 1, P(0) | P(1) | P(2) | P(3)},
+      {"imul", 3, P(1)},
+      {"set*", 1, P(0) | P(1) | P(2) | P(3)},
+      {"cmov*", 1, P(0) | P(1) | P(2) | P(3)},
+      {"cqo", 1, P(0) | P(1) | P(2) | P(3)},
+      {"idiv", 45, P(2), 41},
+      {NULL},
+    },
+  },
+};
+
+static MachineModel *model = &models[0];
+
+// NULLなら既定のモデルに戻す
+void sched_set_model(char *name) {
+  if (!name) {
+    model = &models[0];
+    return;
+  }
+
+  for (int i = 0; i < sizeof(models) / sizeof(*models); i++) {
+    if (!strcmp(models[i].name, name)) {
+      model = &models[i];
+      return;
+    }
+  }
+  error("不明なCPUです: %s", name);
+}
+
+static bool match_op(char *pattern, char *op) {
+  int len = strlen(pattern);
+  if (pattern[len - 1] == '*')
+    return !strncmp(pattern, op, len - 1);
+  return !strcmp(pattern, op);
+}
+
+// モデルにない命令はスケジューリングの境界として扱う
+static InsnModel *find_model(char *op) {
+  for (InsnModel *m = model->insns; m->op; m++)
+    if (match_op(m->op, op))
+      return m;
+  return NULL;
+}
+
+//
+// 命令が読み書きする資源
+//
+
+// レジスタとフラグをビットマスクで表す
+enum {
+  R_RAX, R_RDX, R_RSP, R_RBP,
+  R_R10, R_R11, R_R12, R_R13, R_R14, R_R15,
+  R_FLAGS,
+};
+
+static int reg_id(char *name, int len) {
+  static struct { char *name; int id; } regs[] = {
+    {"rax", R_RAX}, {"eax", R_RAX}, {"al", R_RAX},
+    {"rdx", R_RDX}, {"edx", R_RDX}, {"dl", R_RDX},
+    {"rsp", R_RSP}, {"rbp", R_RBP},
+    {"r10", R_R10}, {"r11", R_R11}, {"r12", R_R12},
+    {"r13", R_R13}, {"r14", R_R14}, {"r15", R_R15},
+  };
+
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+    if (strlen(regs[i].name) == len && !strncmp(regs[i].name, name, len))
+      return regs[i].id;
+  return -1;
+}
+
+typedef struct {
+  Insn *insn;
+  InsnModel *model;
+  unsigned uses; // 読むレジスタとフラグ
+  unsigned defs; // 書くレジスタとフラグ
+  char *addr; // アクセスするメモリのアドレス ([]の中身)
+  bool load;
+  bool store;
+  int latency;
+
+  // スケジューリングの状態
+  int npreds; // まだ発行されていない先行命令の数
+  int height; // ブロックの終わりまでのクリティカルパス長
+  int earliest; // 発行できる最も早いサイクル
+  bool done;
+} SchedInsn;
+
+// []の中に現れるレジスタ
+static unsigned addr_regs(char *opnd) {
+  unsigned mask = 0;
+  for (char *p = strchr(opnd, '['); *p && *p != ']'; ) {
+    if (!isalnum(*p)) {
+      p++;
+      continue;
+    }
+    char *q = p;
+    while (isalnum(*p))
+      p++;
+    int id = reg_id(q, p - q);
+    if (id >= 0)
+      mask |= 1 << id;
+  }
+  return mask;
+}
+
+static char *mem_addr(char *opnd) {
+  return strchr(opnd, '[');
+}
+
+// オペランドiを読む (書く) ことを記録する
+// スタック上のメモリはrspより上でしか有効でないので，メモリを触る命令は
+// rspを読むものとして扱い，rspを変える命令を追い越さないようにする
+static void use(SchedInsn *si, int i) {
+  char *opnd = si->insn->opnd[i];
+  if (mem_addr(opnd)) {
+    si->uses |= addr_regs(opnd) | 1 << R_RSP;
+    si->addr = mem_addr(opnd);
+    si->load = true;
+    return;
+  }
+  int id = reg_id(opnd, strlen(opnd));
+  if (id >= 0)
+    si->uses |= 1 << id;
+}
+
+static void def(SchedInsn *si, int i) {
+  char *opnd = si->insn->opnd[i];
+  if (mem_addr(opnd)) {
+    si->uses |= addr_regs(opnd) | 1 << R_RSP;
+    si->addr = mem_addr(opnd);
+    si->store = true;
+    return;
+  }
+  int id = reg_id(opnd, strlen(opnd));
+  if (id >= 0)
+    si->defs |= 1 << id;
+}
+
+// 命令の意味から資源の読み書きを求める。扱えない命令ならfalseを返す
+static bool analyze(SchedInsn *si) {
+  Insn *insn = si->insn;
+  char *op = insn->op;
+  int n = insn->nopnd;
+
+  si->model = find_model(op);
+  if (!si->model)
+    return false;
+
+  if ((!strcmp(op, "mov") || !strcmp(op, "movzx")) && n == 2) {
+    def(si, 0);
+    use(si, 1);
+  } else if (!strcmp(op, "lea") && n == 2) {
+    def(si, 0);
+    si->uses |= addr_regs(insn->opnd[1]);
+  } else if ((!strcmp(op, "add") || !strcmp(op, "sub")) && n == 2) {
+    use(si, 0);
+    def(si, 0);
+    use(si, 1);
+    si->defs |= 1 << R_FLAGS;
+  } else if (!strcmp(op, "imul") && (n == 2 || n == 3)) {
+    if (n == 2)
+      use(si, 0);
+    def(si, 0);
+    use(si, 1);
+    si->defs |= 1 << R_FLAGS;
+  } else if ((!strcmp(op, "cmp") || !strcmp(op, "test")) && n == 2) {
+    use(si, 0);
+    use(si, 1);
+    si->defs |= 1 << R_FLAGS;
+  } else if (!strncmp(op, "set", 3) && n == 1) {
+    // 下位8ビットだけを書くので元の値も読む
+    use(si, 0);
+    def(si, 0);
+    si->uses |= 1 << R_FLAGS;
+  } else if (!strncmp(op, "cmov", 4) && n == 2) {
+    use(si, 0);
+    def(si, 0);
+    use(si, 1);
+    si->uses |= 1 << R_FLAGS;
+  } else if (!strcmp(op, "cqo") && n == 0) {
+    si->uses |= 1 << R_RAX;
+    si->defs |= 1 << R_RDX;
+  } else if (!strcmp(op, "idiv") && n == 1) {
+    use(si, 0);
+    si->uses |= 1 << R_RAX | 1 << R_RDX;
+    si->defs |= 1 << R_RAX | 1 << R_RDX | 1 << R_FLAGS;
+  } else {
+    return false;
+  }
+
+  si->latency = si->model->latency;
+  if (!strcmp(op, "lea") && strchr(insn->opnd[1], '+') &&
+      strchr(insn->opnd[1], '*') && strpbrk(strchr(insn->opnd[1], '*'), "+-"))
+    si->latency = model->lea3_latency;
+  if (si->load)
+    si->latency = strcmp(op, "mov") ? si->latency + model->load_latency : model->load_latency;
+  return true;
+}
+
+// rbpからの定数オフセットでなければどのアドレスとも重なりうるとみなす
+static bool may_alias(char *a, char *b) {
+  if (strncmp(a, "[rbp-", 5) || strncmp(b, "[rbp-", 5))
+    return true;
+  return !strcmp(a, b);
+}
+
+// iの後にjを置かなければならないとき，その間に必要なサイクル数を返す
+// 依存がなければ-1
+static int dep_latency(SchedInsn *i, SchedInsn *j) {
+  int lat = -1;
+
+  // 真の依存 (書いてから読む)
+  if (i->defs & j->uses)
+    lat = i->latency;
+  if (i->store && j->load && may_alias(i->addr, j->addr))
+    lat = MAX(lat, model->store_forward);
+
+  // 逆依存と出力依存は順序だけを守る
+  if ((i->uses & j->defs) || (i->defs & j->defs))
+    lat = MAX(lat, 0);
+  if (i->addr && j->addr && (i->store || j->store) && may_alias(i->addr, j->addr))
+    lat = MAX(lat, 0);
+  return lat;
+}
+
+//
+// スケジューリング
+//
+
+static void *xcalloc(size_t n, size_t size) {
+  void *p = calloc(n, size);
+  if (!p)
+    error("out of memory");
+  return p;
+}
+
+// 基本ブロック内の命令si[0..n)の発行順をorderに書き，位置が変わった命令の数を返す
+// 依存グラフと発行の計算はO(n^2)なので，nはWINDOW以下に抑えておく
+static int schedule_block(SchedInsn *si, int n, Insn **order) {
+  int *lat = xcalloc(n * n, sizeof(int));
+
+  for (int i = 0; i < n; i++) {
+    for (int j = i + 1; j < n; j++) {
+      lat[i * n + j] = dep_latency(&si[i], &si[j]);
+      if (lat[i * n + j] >= 0)
+        si[j].npreds++;
+    }
+  }
+
+  // 後ろから順にクリティカルパス長を求める
+  for (int i = n - 1; i >= 0; i--) {
+    si[i].height = si[i].latency;
+    for (int j = i + 1; j < n; j++)
+      if (lat[i * n + j] >= 0)
+        si[i].height = MAX(si[i].height, lat[i * n + j] + si[j].height);
+  }
+
+  int port_free[NPORTS] = {0}; // ポートが次に空くサイクル
+  int moved = 0;
+  int cycle = 0;
+
+  for (int scheduled = 0; scheduled < n; cycle++) {
+    unsigned used = 0; // このサイクルで使ったポート
+
+    for (int issued = 0; issued < model->width; issued++) {
+      // 発行可能な命令のうちクリティカルパスが最も長いものを選ぶ
+      SchedInsn *best = NULL;
+      int best_port = 0;
+
+      for (int i = 0; i < n; i++) {
+        SchedInsn *s = &si[i];
+        if (s->done || s->npreds || s->earliest > cycle)
+          continue;
+        if (best && s->height <= best->height)
+          continue;
+
+        // 単純なロードとストアは実行ポートを使わない
+        bool pure_mem = !strcmp(s->insn->op, "mov") && (s->load || s->store);
+        int ports = pure_mem ? (s->load ? model->load_ports : model->store_ports)
+                             : s->model->ports;
+        int port = -1;
+        for (int p = 0; p < NPORTS; p++) {
+          if ((ports & P(p)) && !(used & P(p)) && port_free[p] <= cycle) {
+            port = p;
+            break;
+          }
+        }
+        if (port < 0)
+          continue;
+        best = s;
+        best_port = port;
+      }
+
+      if (!best)
+        break;
+
+      int idx = best - si;
+      best->done = true;
+      used |= P(best_port);
+      port_free[best_port] = cycle + MAX(best->model->busy, 1);
+
+      for (int j = idx + 1; j < n; j++) {
+        if (lat[idx * n + j] < 0)
+          continue;
+        si[j].npreds--;
+        si[j].earliest = MAX(si[j].earliest, cycle + lat[idx * n + j]);
+      }
+
+      if (idx != scheduled)
+        moved++;
+      order[scheduled++] = best->insn;
+    }
+  }
+
+  free(lat);
+  return moved;
+}
+
+int schedule(Function *prog) {
+  int moved = 0;
+
+  for (Insn **cur = &prog->insns; *cur; ) {
+    // 先頭から続く，モデルで扱える命令を基本ブロックとして集める
+    // 長いブロックはWINDOW命令ずつに区切って別々に並べ替える
+    int n = 0;
+    for (Insn *insn = *cur; insn && !insn->label && n < WINDOW; insn = insn->next)
+      n++;
+
+    SchedInsn *si = xcalloc(n + 1, sizeof(SchedInsn));
+    Insn *rest = *cur;
+    int len = 0;
+    for (; len < n; rest = rest->next) {
+      si[len].insn = rest;
+      if (!analyze(&si[len]))
+        break;
+      len++;
+    }
+
+    // ラベルやモデルにない命令 (分岐など) は読み飛ばす
+    if (len < 2) {
+      free(si);
+      cur = &(*cur)->next;
+      continue;
+    }
+
+    Insn **order = xcalloc(len, sizeof(Insn *));
+    moved += schedule_block(si, len, order);
+
+    for (int i = 0; i < len; i++) {
+      *cur = order[i];
+      cur = &order[i]->next;
+    }
+    *cur = rest;
+
+    free(order);
+    free(si);
+  }
+  return moved;
+}
@@ -0,0 +1,251 @@
+#include "9cc.h"
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// コンパイルサーバ
+//
+// 9cc --server <socket> [-j<workers>] でUnixドメインソケットを待ち受け，
+// 起動済みのワーカープロセスでコンパイルする。ワーカーはリクエストごとに
+// アリーナを使い回し，出力はメモリ上に受けるので一時ファイルを作らない。
+//
+// 1つの接続で何回でもリクエストを送れる。整数は全てホストのバイト順。
+//
+//   リクエスト: u32 nargs, u32 len, オプション文字列 (NUL終端) をnargs個，
+//               続けてプログラム (lenはオプションとプログラムの合計バイト数)
+//   レスポンス: u32 status, u32 outlen, u32 errlen, アセンブリ, エラー出力
+//
+// statusは9ccの終了コードと同じく成功なら0，エラーなら1。
+
+#define MAX_REQUEST (16 * 1024 * 1024)
+#define MAX_ARGS 64
+
+static char *socket_path;
+static pid_t *workers;
+static int nworkers;
+
+static bool read_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0; ) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0; ) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// argvを9ccのコマンドラインとしてコンパイルし，出力をout, errに受ける
+static int compile_request(int argc, char **argv, char **out, size_t *outlen,
+                           char **err, size_t *errlen) {
+  // glibcのstdoutとstderrは代入できる変数なので，メモリ上のストリームに差し替える
+  FILE *saved_out = stdout;
+  FILE *saved_err = stderr;
+  FILE *out_fp = open_memstream(out, outlen);
+  FILE *err_fp = open_memstream(err, errlen);
+  if (!out_fp || !err_fp)
+    error("open_memstream failed");
+  stdout = out_fp;
+  stderr = err_fp;
+
+  int status = 0;
+  jmp_buf jmp;
+  arena_reset();
+
+  if (setjmp(jmp) == 0) {
+    error_jmp = &jmp;
+    compile(parse_args(argc, argv));
+  } else {
+    status = 1;
+  }
+
+  error_jmp = NULL;
+  fclose(out_fp);
+  fclose(err_fp);
+  stdout = saved_out;
+  stderr = saved_err;
+  return status;
+}
+
+static bool reply(int fd, int status, char *out, size_t outlen, char *err, size_t errlen) {
+  uint32_t res[3] = {status, outlen, errlen};
+  return write_full(fd, res, sizeof(res)) &&
+    write_full(fd, out, outlen) &&
+    write_full(fd, err, errlen);
+}
+
+// 不正なリクエストにはエラーを返す
+static bool reject(int fd, char *msg) {
+  return reply(fd, 1, NULL, 0, msg, strlen(msg));
+}
+
+// 1つの接続のリクエストを，クライアントが閉じるまで処理する
+static void handle(int fd) {
+  static char *buf;
+  static size_t cap;
+
+  for (;;) {
+    uint32_t hdr[2];
+    if (!read_full(fd, hdr, sizeof(hdr)))
+      return;
+
+    uint32_t nargs = hdr[0];
+    uint32_t len = hdr[1];
+
+    // 本体を読まずに次のリクエストへは進めないので，返事をして切断する
+    if (len > MAX_REQUEST) {
+      reject(fd, "9cc: request too large\n");
+      return;
+    }
+
+    // リクエストのバッファも使い回す
+    if (cap < len + 1) {
+      cap = len + 1;
+      buf = realloc(buf, cap);
+      if (!buf)
+        error("out of memory");
+    }
+    if (!read_full(fd, buf, len))
+      return;
+    buf[len] = '\0';
+
+    if (nargs > MAX_ARGS) {
+      if (!reject(fd, "9cc: too many options\n"))
+        return;
+      continue;
+    }
+
+    // "9cc"，オプション，プログラム，NULL
+    char *argv[MAX_ARGS + 3];
+    int argc = 0;
+    argv[argc++] = "9cc";
+
+    char *p = buf;
+    for (int i = 0; i < nargs; i++) {
+      char *end = memchr(p, '\0', buf + len - p);
+      if (!end)
+        break;
+      argv[argc++] = p;
+      p = end + 1;
+    }
+    if (argc != nargs + 1) {
+      if (!reject(fd, "9cc: malformed request\n"))
+        return;
+      continue;
+    }
+    argv[argc++] = p; // プログラム
+    argv[argc] = NULL;
+
+    char *out = NULL, *err = NULL;
+    size_t outlen = 0, errlen = 0;
+    int status = compile_request(argc, argv, &out, &outlen, &err, &errlen);
+    bool ok = reply(fd, status, out, outlen, err, errlen);
+    free(out);
+    free(err);
+    if (!ok)
+      return;
+  }
+}
+
+static void worker(int sock) {
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  // 返事を読まずに切断されてもwrite_fullが失敗するだけにする
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0)
+      continue;
+    handle(fd);
+    close(fd);
+  }
+}
+
+static pid_t spawn(int sock) {
+  pid_t pid = fork();
+  if (pid < 0)
+    error("fork failed");
+  if (pid == 0) {
+    worker(sock);
+    _exit(0);
+  }
+  return pid;
+}
+
+static void shutdown_server(int sig) {
+  for (int i = 0; i < nworkers; i++)
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+  unlink(socket_path);
+  _exit(0);
+}
+
+int server_main(int argc, char **argv) {
+  nworkers = 4;
+
+  for (int i = 2; i < argc; i++) {
+    if (!strncmp(argv[i], "-j", 2)) {
+      nworkers = atoi(argv[i] + 2);
+      if (nworkers < 1)
+        error("ワーカー数が不正です: %s", argv[i]);
+      continue;
+    }
+    if (socket_path)
+      error("%s: 引数の個数が正しくありません", argv[0]);
+    socket_path = argv[i];
+  }
+  if (!socket_path)
+    error("使い方: %s --server <socket> [-j<workers>]", argv[0]);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  // bindした時点でソケットのファイルができるが，listenするまでは接続できない。
+  // 別の名前でlistenしてからrenameし，ファイルが見えたら接続できるようにする
+  char tmp_path[sizeof(addr.sun_path)];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", socket_path, getpid()) >= sizeof(tmp_path))
+    error("ソケットのパスが長すぎます: %s", socket_path);
+  strcpy(addr.sun_path, tmp_path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    error("socket failed");
+  unlink(tmp_path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    error("%s にbindできません", tmp_path);
+  if (listen(sock, 128) < 0 || rename(tmp_path, socket_path) < 0) {
+    unlink(tmp_path);
+    error("%s で待ち受けできません", socket_path);
+  }
+
+  workers = calloc(nworkers, sizeof(pid_t));
+  signal(SIGTERM, shutdown_server);
+  signal(SIGINT, shutdown_server);
+  for (int i = 0; i < nworkers; i++)
+    workers[i] = spawn(sock);
+
+  // 落ちたワーカーは起動し直す
+  for (;;) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
+      continue;
+    for (int i = 0; i < nworkers; i++)
+      if (workers[i] == pid)
+        workers[i] = spawn(sock);
+  }
+}
@@ -1,19 +1,21 @@
 #!/bin/bash
+# 全ての最適化レベルで同じ結果になることを確認する
 assert() {
   expected="$1"
   input="$2"
 
-  ./9cc "$input" > tmp.s || exit
-  gcc -static -o tmp tmp.s
-  ./tmp
-  actual="$?"
-
-  if [ "$actual" = "$expected" ]; then
-    echo "$input => $actual"
-  else
-    echo "$input => $expected expected, but got $actual"
-    exit 1
-  fi
+  for opt in -O0 -O1 -O2; do
+    ./9cc $opt "$input" > tmp.s || exit
+    gcc -static -o tmp tmp.s
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" != "$expected" ]; then
+      echo "$opt $input => $expected expected, but got $actual"
+      exit 1
+    fi
+  done
+  echo "$input => $actual"
 }
 
 assert 0 '{ return 0; }'
@@ -74,4 +76,94 @@ assert 3 '{ {1; {2;} return 3;} }'
 assert 10 '{ i=0; while(i<10) i=i+1; return i; }'
 assert 55 '{ i=0; j=0; while(i<=10) {j=i+j; i=i+1;} return j; }'
 
+assert 7 '{ a=7; return a*1+0; }'
+assert 0 '{ a=7; return a*0; }'
+assert 3 '{ a=0; b=a*(a=3); return a; }'
+assert 5 '{ if (1) return 5; else return 6; }'
+assert 6 '{ for (i=4; 0; i=i+1) return 9; return i+2; }'
+assert 2 '{ x=10; y=0; if (y) x=x/y; return 2; }'
+
+assert 18 '{ a=3; b=2; c=7; return a+b*4+c; }'
+assert 18 '{ a=3; b=2; return a+4*b+7; }'
+assert 15 '{ a=3; return a*5; }'
+assert 27 '{ a=3; return 9*a; }'
+assert 12 '{ a=3; return 4*a; }'
+assert 8 '{ a=3; return a+5; }'
+assert 2 '{ a=3; return 5-a; }'
+assert 1 '{ a=3; return 2<a; }'
+assert 0 '{ a=3; return a<=2; }'
+assert 1 '{ a=3; b=3; return a==b; }'
+assert 4 '{ a=9; b=2; return a/b; }'
+
+# 左から順に評価する
+assert 6 '{ a=1; return a+(a=5); }'
+assert 10 '{ a=2; return a*(a=5); }'
+assert 1 '{ a=1; return a<(a=5); }'
+assert 0 '{ a=1; return a==(a=1)+1; }'
+
+assert 3 '{ a=3; b=5; if (a<b) m=a; else m=b; return m; }'
+assert 5 '{ a=3; b=5; if (a<b) { m=b; } else { m=a; } return m; }'
+assert 5 '{ a=3; b=5; if (a<=b) return b; else return a; }'
+assert 7 '{ c=3; a=3; if (a==3) c=c+4; return c; }'
+assert 3 '{ c=3; a=2; if (a==3) c=c+4; return c; }'
+assert 1 '{ c=3; a=2; if (a!=3) c=c-2; return c; }'
+assert 9 '{ m=1; a=9; if (m<a) m=a; return m; }'
+assert 1 '{ a=3; if (a) m=1; else m=0; return m; }'
+assert 0 '{ a=0; if (a) m=1; else m=0; return m; }'
+assert 4 '{ a=3; b=4; if (a<b) if (a<1) m=1; else m=b; else m=a; return m; }'
+assert 1 '{ a=1; b=2; m=0; if ((a*b)+((a*b)+((a*b)+((a*b)+((a*b)+(a*b))))) < 100) m=a; else m=b; return m; }'
+assert 2 '{ a=1; b=2; if (100 < (a*b)+((a*b)+((a*b)+((a*b)+((a*b)+(a*b)))))) return a; else return b; }'
+assert 7 '{ a=1; c=3; if ((a*a)+((a*a)+((a*a)+((a*a)+((a*a)+(a*a))))) < 100) c=c+4; return c; }'
+
+# パスの個別指定
+./9cc -O0 -ffold -ftime-report '{ return 2*3; }' > /dev/null 2> tmp.log || exit
+grep -q '^  fold' tmp.log || { echo "-ffold was not run"; exit 1; }
+./9cc -O2 -fno-simplify '{ return 2*3; }' > /dev/null || exit
+./9cc -O2 -fno-fold -ftime-report '{ return 2*3; }' > /dev/null 2> tmp.log || exit
+grep -q '^  fold' tmp.log && { echo "-fno-fold was ignored"; exit 1; }
+grep -q '^  simplify' tmp.log || { echo "simplify was not run without fold"; exit 1; }
+for opt in -O1 -O2; do
+  ./9cc $opt -fno-fold '{ a=2; return a*3+0; }' > tmp.s || exit
+  gcc -static -o tmp tmp.s
+  ./tmp; [ "$?" = 6 ] || { echo "$opt -fno-fold: wrong result"; exit 1; }
+done
+
+# if変換とプロファイル
+./9cc -O2 '{ a=3; b=5; if (a<b) m=a; else m=b; return m; }' | grep -q cmov || { echo "ifcvt: cmov expected"; exit 1; }
+echo '0 1000 2' > tmp.prof
+./9cc -O2 -fprofile-use=tmp.prof '{ a=3; b=5; if (a<b) m=a; else m=b; return m; }' | grep -q cmov && { echo "ifcvt: predictable branch was converted"; exit 1; }
+echo '0 500 500' > tmp.prof
+./9cc -O2 -fprofile-use=tmp.prof '{ a=3; b=5; if (a<b) m=a; else m=b; return m; }' | grep -q cmov || { echo "ifcvt: unpredictable branch was kept"; exit 1; }
+
+# スケジューラのマシンモデル
+for tune in skylake znver2; do
+  ./9cc -O0 -fsched -mtune=$tune '{ a=7; b=3; c=a*b; d=a/b; return c+d*4+a; }' > tmp.s || exit
+  gcc -static -o tmp tmp.s
+  ./tmp
+  [ "$?" = 36 ] || { echo "-mtune=$tune: 36 expected"; exit 1; }
+done
+./9cc -mtune=pentium '{ return 0; }' > /dev/null 2>&1 && { echo "unknown -mtune accepted"; exit 1; }
+
+# スケジューリングの窓より長い基本ブロック (1000 * 3 = 3000 = 184 mod 256)
+assert 184 "{ a=0; i=3; $(printf 'a=a+i; %.0s' $(seq 1000)) return a; }"
+
+# コンパイルサーバ
+./9cc --server tmp.sock -j2 &
+server=$!
+trap 'kill $server 2> /dev/null' EXIT
+for i in $(seq 50); do [ -S tmp.sock ] && break; sleep 0.1; done
+
+for opt in -O0 -O2; do
+  ./9cc-client -S tmp.sock $opt '{ a=3; b=4; return a*b+2; }' > tmp.s || exit
+  gcc -static -o tmp tmp.s
+  ./tmp
+  [ "$?" = 14 ] || { echo "9cc-client $opt: 14 expected"; exit 1; }
+done
+./9cc-client -S tmp.sock '{ 1=2; }' > /dev/null 2> tmp.log && { echo "9cc-client: error expected"; exit 1; }
+grep -q 'not an lvalue' tmp.log || { echo "9cc-client: error message was lost"; exit 1; }
+./9cc-client -S tmp.sock '{ return 5; }' > tmp.s || { echo "9cc-client: server did not recover"; exit 1; }
+./9cc-client -S tmp.sock $(printf -- '-O0 %.0s' $(seq 64)) '{ return 5; }' > tmp.s || { echo "9cc-client: 64 options rejected"; exit 1; }
+./9cc-client -S tmp.sock $(printf -- '-O0 %.0s' $(seq 65)) '{ return 5; }' > /dev/null 2> tmp.log && { echo "9cc-client: 65 options accepted"; exit 1; }
+grep -q 'too many options' tmp.log || { echo "9cc-client: too many options was not reported"; exit 1; }
+
 echo OK
@@ -3,13 +3,22 @@
 // 入力プログラム
 static char *current_input;
 
+// NULLでなければ，エラーのときにexitせずここに戻る (コンパイルサーバ用)
+jmp_buf *error_jmp;
+
+static void fail(void) {
+  if (error_jmp)
+    longjmp(*error_jmp, 1);
+  exit(1);
+}
+
 // エラーを報告するための関数
 void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
-  exit(1);
+  fail();
 }
 
 // エラー箇所を報告するための関数
@@ -21,7 +30,7 @@ static void verror_at(char *loc, char *fmt, va_list ap){
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap); // apのデータをfmtに従ってstderrに出力 
   fprintf(stderr, "\n");
-  exit(1);
+  fail();
 }
 
 static void error_at(char *loc, char *fmt, ...) {
@@ -52,7 +61,7 @@ Token *skip(Token *tok, char *op) {
 // 新しいトークンをつないでcurにつなげる
 Token *new_token(TokenKind kind, Token *cur, char *str, int len){
   // ヒープメモリからsizeバイトのブロックを1個割り当て
-  Token *tok = calloc(1, sizeof(Token)); 
+  Token *tok = arena_calloc(1, sizeof(Token)); 
   tok->kind = kind;
   tok->loc = str;
   tok->len = len;